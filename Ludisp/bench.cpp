@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "binning.h"
+#include "tonemap.h"
+#include "threadpool.h"
+#include "calibration.h"
+#include "demosaic.h"
+#include "fitsdirect.h"
+#include "fitswriter.h"
+#include "hotpixels.h"
+#include "simcamera.h"
+#include "statistics.h"
+
+// Micro-benchmarks for the Ludisp processing stages. Needs neither a camera
+// nor a window, so it runs anywhere the sources compile.
+
+template<typename Func>
+double TimeMs(int iterations, Func const& func)
+{
+    func(); // warm up caches and page in the buffers
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        func();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+std::vector<uint16_t> SyntheticFrame(int width, int height)
+{
+    // sky background with read noise; cheap LCG so runs are reproducible
+    std::vector<uint16_t> pixels((size_t)width * height);
+    uint32_t state = 12345;
+    for (auto& pixel : pixels)
+    {
+        state = state * 1664525 + 1013904223;
+        pixel = (uint16_t)(2000 + (state >> 20));
+    }
+    return pixels;
+}
+
+void Report(std::string const& name, double ms, double baselineMs, long numPixels)
+{
+    std::cout << std::left << std::setw(28) << name << std::right
+        << std::fixed << std::setprecision(2)
+        << std::setw(9) << ms << " ms"
+        << std::setw(9) << numPixels / ms / 1000 << " Mpix/s"
+        << std::setw(8) << baselineMs / ms << "x" << std::endl;
+}
+
+static const SimdLevel simdLevels[] = { SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2 };
+static const int threadCounts[] = { 1, 2, 4, 8 };
+
+// Times run(level) at every SIMD level the CPU has and checks each result
+// with matches(level). Speed-ups are against baselineMs, or against the
+// scalar kernel if that is 0.
+template<typename Run, typename Check>
+void BenchLevels(std::string const& name, int iterations, long numPixels, double baselineMs,
+        Run const& run, Check const& matches)
+{
+    for (auto level : simdLevels)
+    {
+        if (level > DetectSimd())
+            continue;
+        auto ms = TimeMs(iterations, [&]() { run(level); });
+        if (!matches(level))
+            throw std::runtime_error(name + " mismatch in " + SimdName(level) + " kernel");
+        if (baselineMs == 0)
+            baselineMs = ms;
+        Report(name + " " + SimdName(level), ms, baselineMs, numPixels);
+    }
+}
+
+// Times run(pool) with 1 to 8 threads; speed-ups are against 1 thread.
+template<typename Run>
+void BenchThreads(std::string const& name, int iterations, long numPixels, Run const& run)
+{
+    double singleMs = 0;
+    for (int threads : threadCounts)
+    {
+        ThreadPool pool(threads);
+        auto ms = TimeMs(iterations, [&]() { run(pool); });
+        if (threads == 1)
+            singleMs = ms;
+        Report((name.empty() ? "" : name + " ") + std::to_string(threads) + " threads",
+                ms, singleMs, numPixels);
+    }
+}
+
+void BenchToneMap(int width, int height, int iterations)
+{
+    std::cout << "Tone map " << width << "x" << height << std::endl;
+    auto pixels = SyntheticFrame(width, height);
+    long numPixels = (long)width * height;
+    std::vector<uint8_t> rgb(numPixels * 3);
+    std::vector<uint32_t> xrgb(numPixels);
+    std::vector<uint32_t> reference(numPixels);
+    double gamma = 0.5;
+    double darkThresh = 1000;
+    ToneMap toneMap;
+    toneMap.Update(gamma, darkThresh);
+
+    // the original DispPixels loop: pow() per pixel and a crosshair test
+    auto powMs = TimeMs(1, [&]()
+            {
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    double value = ((double)pixels[y * width + x] - darkThresh) / 65535;
+                    value = value <= 0 ? 0 : pow(value, gamma);
+                    uint8_t pixcol = (uint8_t)(value * 255);
+                    int index = (y * width + x) * 3;
+                    rgb[index + 0] = pixcol;
+                    rgb[index + 1] = pixcol;
+                    rgb[index + 2] = pixcol;
+                    if (y == height / 2 || x == width / 2)
+                        rgb[index] = 255;
+                }
+            }
+            });
+    Report("pow, RGB24", powMs, powMs, numPixels);
+
+    auto lutMs = TimeMs(iterations, [&]()
+            {
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    uint8_t pixcol = toneMap[pixels[y * width + x]];
+                    int index = (y * width + x) * 3;
+                    rgb[index + 0] = pixcol;
+                    rgb[index + 1] = pixcol;
+                    rgb[index + 2] = pixcol;
+                    if (y == height / 2 || x == width / 2)
+                        rgb[index] = 255;
+                }
+            }
+            });
+    Report("LUT, RGB24", lutMs, powMs, numPixels);
+
+    toneMap.Apply(pixels.data(), reference.data(), numPixels, SimdLevel::Scalar);
+    BenchLevels("LUT, XRGB8888", iterations, numPixels, powMs,
+            [&](SimdLevel level)
+            {
+            for (int y = 0; y < height; y++)
+                toneMap.Apply(pixels.data() + (long)y * width, xrgb.data() + (long)y * width, width, level);
+            },
+            [&](SimdLevel) { return xrgb == reference; });
+}
+
+void BenchToneMapThreads(int width, int height, int iterations)
+{
+    std::cout << "Tone map " << width << "x" << height << ", " << SimdName(DetectSimd())
+        << ", row bands" << std::endl;
+    auto pixels = SyntheticFrame(width, height);
+    long numPixels = (long)width * height;
+    std::vector<uint32_t> xrgb(numPixels);
+    ToneMap toneMap;
+    toneMap.Update(0.5, 1000);
+    BenchThreads("", iterations, numPixels, [&](ThreadPool& pool)
+            {
+            pool.ParallelRows(height, 16, [&](int begin, int end)
+                    {
+                    for (int y = begin; y < end; y++)
+                        toneMap.Apply(pixels.data() + (long)y * width, xrgb.data() + (long)y * width, width);
+                    });
+            });
+}
+
+void BenchCalibration(int width, int height, int iterations)
+{
+    std::cout << "Dark/flat calibration " << width << "x" << height << ", "
+        << SimdName(DetectSimd()) << std::endl;
+    long numPixels = (long)width * height;
+    auto raw = SyntheticFrame(width, height);
+    std::vector<uint16_t> pixels(raw);
+    // flat dark current plus a vignetted flat
+    std::vector<float> dark(numPixels, 100.0f);
+    std::vector<float> flat(numPixels);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            flat[(long)y * width + x] = 30000.0f - 0.001f *
+                ((x - width / 2) * (x - width / 2) + (y - height / 2) * (y - height / 2));
+    Calibration calibration(1, Calibration::Combine::Mean);
+    calibration.SetDark(dark, width, height);
+    calibration.SetFlat(flat, width, height);
+    BenchThreads("", iterations, numPixels, [&](ThreadPool& pool)
+            {
+            std::copy(raw.begin(), raw.end(), pixels.begin());
+            calibration.Apply(pixels.data(), width, height, pool);
+            });
+}
+
+void BenchStatistics(int width, int height, int iterations)
+{
+    std::cout << "Frame statistics " << width << "x" << height << std::endl;
+    long numPixels = (long)width * height;
+    auto pixels = SyntheticFrame(width, height);
+    FramePool frames(1, numPixels);
+    auto frame = frames.Acquire(width, height);
+    std::copy(pixels.begin(), pixels.end(), frame->data());
+    Statistics sampled;
+    BenchThreads("", iterations, numPixels, [&](ThreadPool& pool) { sampled.Compute(*frame, pool); });
+    // every pixel, to check the sampled estimates against
+    ThreadPool pool(1);
+    Statistics full(numPixels);
+    full.Compute(*frame, pool);
+    auto exact = full.Latest();
+    auto stats = sampled.Latest();
+    std::cout << "  median " << exact.median << " vs " << stats.median
+        << ", MAD " << exact.mad << " vs " << stats.mad
+        << ", black " << exact.black << " vs " << stats.black << std::endl;
+}
+
+void BenchBinning(int width, int height, int iterations)
+{
+    std::cout << "Software binning " << width << "x" << height << std::endl;
+    long numPixels = (long)width * height;
+    // bright enough that 2x2 sums and up saturate in places
+    auto pixels = SyntheticFrame(width, height);
+    for (long i = 0; i < numPixels; i += 7)
+        pixels[i] = (uint16_t)(pixels[i] * 13);
+    std::vector<uint16_t> binned(numPixels);
+    std::vector<uint16_t> reference(numPixels);
+    std::vector<uint16_t> scratch(BinScratchSize(width, height, 2));
+    ThreadPool single(1);
+    for (int factor = 2; factor <= 4; factor++)
+    {
+        long outPixels = (long)(width / factor) * (height / factor);
+        // plain 32-bit sums for checking the saturating kernels
+        for (int y = 0; y < height / factor; y++)
+        {
+            for (int x = 0; x < width / factor; x++)
+            {
+                uint32_t sum = 0;
+                for (int dy = 0; dy < factor; dy++)
+                    for (int dx = 0; dx < factor; dx++)
+                        sum += pixels[(long)(y * factor + dy) * width + x * factor + dx];
+                reference[(long)y * (width / factor) + x] = (uint16_t)std::min(sum, 65535u);
+            }
+        }
+        BenchLevels(std::to_string(factor) + "x" + std::to_string(factor), iterations, numPixels, 0,
+                [&](SimdLevel level) { Bin(pixels.data(), width, height, factor, binned.data(), scratch, single, level); },
+                [&](SimdLevel)
+                {
+                return !memcmp(binned.data(), reference.data(), outPixels * sizeof(uint16_t));
+                });
+    }
+    BenchThreads("2x2", iterations, numPixels, [&](ThreadPool& pool)
+            {
+            Bin(pixels.data(), width, height, 2, binned.data(), scratch, pool);
+            });
+}
+
+void BenchHotPixels(int iterations)
+{
+    std::cout << "Hot pixel correction" << std::endl;
+    int sizes[][2] = { { 1392, 1040 }, { 4096, 3000 } };
+    for (auto size : sizes)
+    {
+        int width = size[0];
+        int height = size[1];
+        long numPixels = (long)width * height;
+        // a noisy dark with the same density of hot pixels at both sizes, a
+        // few of them in pairs and one in a corner; Mpix/s counts corrected
+        // pixels here
+        std::vector<float> dark(numPixels);
+        uint32_t state = 777;
+        for (auto& value : dark)
+        {
+            state = state * 1664525 + 1013904223;
+            value = 100.0f + (state >> 28);
+        }
+        long planted = 0;
+        for (long i = width + 1; i < numPixels; i += 9973, planted++)
+            dark[i] = 3000;
+        for (long i = 3 * width + 7; i + 1 < numPixels; i += 99991, planted++)
+            dark[i + 1] = 2500;
+        dark[0] = 5000;
+        planted++;
+        HotPixelMap map;
+        map.Build(dark, width, height);
+        if ((long)map.Count() != planted)
+            throw std::runtime_error("Hot pixel map found " + std::to_string(map.Count()) +
+                    " of " + std::to_string(planted));
+
+        auto raw = SyntheticFrame(width, height);
+        for (auto index : map.Indices())
+            raw[index] = 60000;
+        std::vector<uint16_t> reference(raw);
+        map.Correct(reference.data(), width, height, SimdLevel::Scalar);
+        std::vector<uint16_t> pixels(raw);
+        BenchLevels(std::to_string(width) + "x" + std::to_string(height) + ", " + std::to_string(map.Count()),
+                iterations, (long)map.Count(), 0,
+                [&](SimdLevel level)
+                {
+                for (auto index : map.Indices())
+                    pixels[index] = 60000;
+                map.Correct(pixels.data(), width, height, level);
+                },
+                [&](SimdLevel) { return pixels == reference; });
+    }
+}
+
+void BenchDemosaic(int width, int height, int iterations)
+{
+    std::cout << "Bayer demosaic " << width << "x" << height << ", RGGB" << std::endl;
+    long numPixels = (long)width * height;
+    // a colour scene with smooth gradients and hard diagonal stripes,
+    // sampled through the filter, so both paths can be checked against it
+    std::vector<float> truth(numPixels * 3);
+    std::vector<uint16_t> mosaic(numPixels);
+    std::vector<float> mosaicFloat(numPixels);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            long i = (long)y * width + x;
+            bool stripe = ((x + y) / 24) % 2;
+            truth[i] = 4000.0f + 20000.0f * x / width + (stripe ? 12000 : 0);
+            truth[numPixels + i] = 8000.0f + 20000.0f * y / height + (stripe ? 8000 : 0);
+            truth[2 * numPixels + i] = 30000.0f - 20000.0f * x / width + (stripe ? 4000 : 0);
+            int channel = (y % 2 == 0 && x % 2 == 0) ? 0 : (y % 2 == 1 && x % 2 == 1) ? 2 : 1;
+            mosaicFloat[i] = truth[channel * numPixels + i];
+            mosaic[i] = (uint16_t)mosaicFloat[i];
+        }
+    }
+    auto rmsError = [&](std::vector<float> const& rgb)
+    {
+        double sum = 0;
+        for (long i = 0; i < numPixels * 3; i++)
+            sum += (rgb[i] - truth[i]) * (rgb[i] - truth[i]);
+        return std::sqrt(sum / (numPixels * 3));
+    };
+
+    std::vector<uint16_t> reference(numPixels * 3);
+    std::vector<uint16_t> rgb(numPixels * 3);
+    auto bilinear = [&](std::vector<uint16_t>& out, ThreadPool& pool, SimdLevel level)
+    {
+        pool.ParallelRows(height, 16, [&](int begin, int end)
+                {
+                for (int y = begin; y < end; y++)
+                    DemosaicRow(mosaic.data(), width, height, CfaPattern::Rggb, y, 0, width,
+                            &out[(size_t)y * width], &out[numPixels + (size_t)y * width],
+                            &out[2 * numPixels + (size_t)y * width], level);
+                });
+    };
+    ThreadPool single(1);
+    bilinear(reference, single, SimdLevel::Scalar);
+    BenchLevels("bilinear", iterations, numPixels, 0,
+            [&](SimdLevel level) { bilinear(rgb, single, level); },
+            [&](SimdLevel) { return rgb == reference; });
+
+    std::vector<float> qualityReference(numPixels * 3);
+    std::vector<float> quality(numPixels * 3);
+    Demosaic(mosaicFloat.data(), width, height, CfaPattern::Rggb, qualityReference.data(), single,
+            SimdLevel::Scalar);
+    BenchLevels("quality", iterations, numPixels, 0,
+            [&](SimdLevel level)
+            {
+            Demosaic(mosaicFloat.data(), width, height, CfaPattern::Rggb, quality.data(), single, level);
+            },
+            [&](SimdLevel)
+            {
+            for (long i = 0; i < numPixels * 3; i++)
+                if (std::fabs(quality[i] - qualityReference[i]) > 0.01f)
+                    return false;
+            return true;
+            });
+    BenchThreads("bilinear", iterations, numPixels, [&](ThreadPool& pool) { bilinear(rgb, pool, DetectSimd()); });
+    BenchThreads("quality", iterations, numPixels, [&](ThreadPool& pool)
+            {
+            Demosaic(mosaicFloat.data(), width, height, CfaPattern::Rggb, quality.data(), pool);
+            });
+    std::vector<float> bilinearFloat(reference.begin(), reference.end());
+    std::cout << "  RMS error: bilinear " << rmsError(bilinearFloat)
+        << ", quality " << rmsError(qualityReference) << std::endl;
+}
+
+void BenchFitsOrder(int width, int height, int iterations)
+{
+    std::cout << "FITS byte order " << width << "x" << height << std::endl;
+    auto pixels = SyntheticFrame(width, height);
+    long numPixels = (long)width * height;
+    std::vector<uint16_t> disk(numPixels);
+    std::vector<uint16_t> back(numPixels);
+    BenchLevels("to FITS", iterations, numPixels, 0,
+            [&](SimdLevel level) { ToFitsOrder(pixels.data(), disk.data(), numPixels, level); },
+            [&](SimdLevel level)
+            {
+            FromFitsOrder(disk.data(), back.data(), numPixels, level);
+            auto bytes = reinterpret_cast<uint8_t const*>(disk.data());
+            // big-endian pixel - 32768, as cfitsio would have stored it
+            return back == pixels && bytes[0] == (uint8_t)((pixels[0] ^ 0x8000) >> 8);
+            });
+}
+
+void BenchCompression(int width, int height, int iterations)
+{
+    std::cout << "FITS output " << width << "x" << height << ", shot-noise star field" << std::endl;
+    SimSettings sim;
+    sim.width = width;
+    sim.height = height;
+    sim.fps = 0;
+    sim.noise = SimSettings::Noise::Shot;
+    SimCamera camera(sim);
+    std::vector<uint16_t> pixels((size_t)width * height);
+    camera.StartStreaming();
+    camera.Capture(pixels.data());
+    double rawMb = pixels.size() * sizeof(uint16_t) / 1e6;
+
+    struct Case
+    {
+        char const* name;
+        FitsCompression compression;
+    };
+    Case cases[] = {
+        { "uncompressed", FitsCompression::None },
+        { "Rice", FitsCompression::Rice },
+        { "HCOMPRESS", FitsCompression::Hcompress },
+    };
+    for (auto const& c : cases)
+    {
+        for (int threads : threadCounts)
+        {
+            // every thread writes its own frame, like the writer's workers
+            ThreadPool pool(threads);
+            auto ms = TimeMs(iterations, [&]()
+                    {
+                    pool.ParallelFor(threads, [&](int i)
+                            {
+                            auto name = "/tmp/ludisp-bench-" + std::to_string(i) + ".fits";
+                            if (c.compression == FitsCompression::None)
+                                WriteFitsDirect(name, pixels.data(), width, height);
+                            else
+                                WriteFitsCompressed(name, pixels.data(), width, height, c.compression);
+                            });
+                    });
+            struct stat info;
+            if (stat("/tmp/ludisp-bench-0.fits", &info) != 0)
+                throw std::runtime_error("Benchmark file was not written");
+            std::cout << std::left << std::setw(14) << c.name << std::right
+                << std::setw(2) << threads << " threads"
+                << std::fixed << std::setprecision(2)
+                << std::setw(9) << ms / threads << " ms/frame"
+                << std::setw(9) << rawMb * threads / ms * 1000 << " MB/s"
+                << std::setw(7) << rawMb * 1e6 / info.st_size << ":1" << std::endl;
+            for (int i = 0; i < threads; i++)
+                remove(("/tmp/ludisp-bench-" + std::to_string(i) + ".fits").c_str());
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        int iterations = argc > 1 ? std::stoi(argv[1]) : 10;
+        BenchToneMap(4096, 3000, iterations);
+        BenchToneMapThreads(4096, 3000, iterations);
+        BenchCalibration(4096, 3000, iterations);
+        BenchStatistics(4096, 3000, iterations * 10);
+        BenchBinning(4096, 3000, iterations);
+        BenchHotPixels(iterations * 100);
+        BenchDemosaic(4096, 3000, iterations);
+        BenchFitsOrder(4096, 3000, iterations);
+        BenchCompression(4096, 3000, std::max(iterations / 5, 1));
+    }
+    catch (std::exception const& ex)
+    {
+        std::cout << "Exception!" << std::endl;
+        std::cout << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "binning.h"
+
+// acc[i] = min(acc[i] + src[i], 65535)
+static void AccumulateScalar(uint16_t* acc, uint16_t const* src, int count)
+{
+    for (int i = 0; i < count; i++)
+        acc[i] = (uint16_t)std::min(acc[i] + src[i], 65535);
+}
+
+// dst[i] = min(src[2i] + src[2i + 1], 65535)
+static void FoldPairsScalar(uint16_t const* src, uint16_t* dst, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = (uint16_t)std::min(src[2 * i] + src[2 * i + 1], 65535);
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void AccumulateSse2(uint16_t* acc, uint16_t const* src, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto out = reinterpret_cast<__m128i*>(acc + i);
+        __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+        _mm_storeu_si128(out, _mm_adds_epu16(_mm_loadu_si128(out), x));
+    }
+    AccumulateScalar(acc + i, src + i, count - i);
+}
+
+// Adds the two halves of every dword with unsigned saturation, leaving the
+// sum in the low half.
+TARGET_SSE2 static inline __m128i SumPairs(__m128i x)
+{
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    return _mm_adds_epu16(_mm_and_si128(x, low), _mm_srli_epi32(x, 16));
+}
+
+TARGET_SSE2 static void FoldPairsSse2(uint16_t const* src, uint16_t* dst, int count)
+{
+    // SSE2 only packs with signed saturation, so the dwords are biased into
+    // the signed range first and the words unbiased afterwards.
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    const __m128i unbias = _mm_set1_epi16((short)0x8000);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = SumPairs(_mm_loadu_si128(reinterpret_cast<__m128i const*>(src + 2 * i)));
+        __m128i b = SumPairs(_mm_loadu_si128(reinterpret_cast<__m128i const*>(src + 2 * i + 8)));
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(packed, unbias));
+    }
+    FoldPairsScalar(src + 2 * i, dst + i, count - i);
+}
+
+TARGET_AVX2 static void AccumulateAvx2(uint16_t* acc, uint16_t const* src, int count)
+{
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        auto out = reinterpret_cast<__m256i*>(acc + i);
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+        _mm256_storeu_si256(out, _mm256_adds_epu16(_mm256_loadu_si256(out), x));
+    }
+    AccumulateScalar(acc + i, src + i, count - i);
+}
+
+TARGET_AVX2 static void FoldPairsAvx2(uint16_t const* src, uint16_t* dst, int count)
+{
+    const __m256i low = _mm256_set1_epi32(0xFFFF);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + 2 * i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + 2 * i + 16));
+        a = _mm256_adds_epu16(_mm256_and_si256(a, low), _mm256_srli_epi32(a, 16));
+        b = _mm256_adds_epu16(_mm256_and_si256(b, low), _mm256_srli_epi32(b, 16));
+        // packs within each 128-bit lane, so the middle quadwords swap back
+        __m256i packed = _mm256_packus_epi32(a, b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    FoldPairsScalar(src + 2 * i, dst + i, count - i);
+}
+#endif
+
+size_t BinScratchSize(int width, int height, int factor)
+{
+    if (factor < 1)
+        return 0;
+    int outHeight = height / factor;
+    size_t span = (size_t)(width / factor) * factor;
+    // the summed rows, then the first fold of a factor of 4
+    return (size_t)(outHeight + binRowAlign - 1) / binRowAlign * (span + span / 2 + 1);
+}
+
+void Bin(uint16_t const* src, int width, int height, int factor, uint16_t* dst,
+        std::vector<uint16_t>& scratch, ThreadPool& pool, SimdLevel level)
+{
+    if (factor < 1)
+        throw std::runtime_error("Binning factor must be at least 1");
+    size_t scratchSize = BinScratchSize(width, height, factor);
+    if (scratch.size() < scratchSize)
+        scratch.resize(scratchSize);
+    auto accumulate = AccumulateScalar;
+    auto foldPairs = FoldPairsScalar;
+#if LUDISP_X86
+    if (level == SimdLevel::Avx2)
+    {
+        accumulate = AccumulateAvx2;
+        foldPairs = FoldPairsAvx2;
+    }
+    else if (level == SimdLevel::Sse2)
+    {
+        accumulate = AccumulateSse2;
+        foldPairs = FoldPairsSse2;
+    }
+#else
+    (void)level;
+#endif
+    int outWidth = width / factor;
+    int outHeight = height / factor;
+    int span = outWidth * factor;
+    size_t bandSize = (size_t)span + span / 2 + 1;
+    pool.ParallelRows(outHeight, binRowAlign, [&](int begin, int end)
+            {
+            auto acc = scratch.data() + (size_t)(begin / binRowAlign) * bandSize;
+            auto half = acc + span;
+            for (int y = begin; y < end; y++)
+            {
+                auto row = src + (size_t)y * factor * width;
+                std::copy(row, row + span, acc);
+                for (int k = 1; k < factor; k++)
+                    accumulate(acc, row + (size_t)k * width, span);
+                auto out = dst + (size_t)y * outWidth;
+                if (factor == 1)
+                    std::copy(acc, acc + span, out);
+                else if (factor == 2)
+                    foldPairs(acc, out, outWidth);
+                else if (factor == 4)
+                {
+                    foldPairs(acc, half, outWidth * 2);
+                    foldPairs(half, out, outWidth);
+                }
+                else if (factor == 3)
+                {
+                    // odd factors don't split into pairs; the rows are
+                    // already summed, so this is 1/factor of the reads
+                    auto in = acc;
+                    for (int x = 0; x < outWidth; x++, in += 3)
+                        out[x] = (uint16_t)std::min(in[0] + in[1] + in[2], 65535);
+                }
+                else
+                {
+                    for (int x = 0; x < outWidth; x++)
+                    {
+                        int sum = 0;
+                        for (int k = 0; k < factor; k++)
+                            sum += acc[x * factor + k];
+                        out[x] = (uint16_t)std::min(sum, 65535);
+                    }
+                }
+            }
+            });
+}
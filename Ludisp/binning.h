@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "simd.h"
+#include "threadpool.h"
+
+// Software binning for cameras that can't bin on the sensor. Each output
+// pixel is the sum of a factor x factor block, saturating at 65535 like
+// charge binning into a full well. The output is width / factor by
+// height / factor; partial blocks at the right and bottom edges are
+// dropped. Rows are summed with saturating vector adds first and then folded
+// horizontally, which gives the same result as one saturating sum.
+//
+// Each band of binRowAlign output rows sums into its own part of scratch.
+// Bin grows scratch to BinScratchSize first if it is smaller, so callers on
+// a hot path size it once up front.
+void Bin(uint16_t const* src, int width, int height, int factor, uint16_t* dst,
+        std::vector<uint16_t>& scratch, ThreadPool& pool, SimdLevel level);
+
+inline void Bin(uint16_t const* src, int width, int height, int factor, uint16_t* dst,
+        std::vector<uint16_t>& scratch, ThreadPool& pool)
+{
+    Bin(src, width, height, factor, dst, scratch, pool, DetectSimd());
+}
+
+static const int binRowAlign = 8;
+
+size_t BinScratchSize(int width, int height, int factor);
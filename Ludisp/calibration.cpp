@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include "calibration.h"
+#include "fitswriter.h"
+#include "simd.h"
+
+Calibration::Calibration(int numFrames, Combine combine, double hotPixelSigma)
+    : numFrames(std::max(numFrames, 1)), combine(combine), hotPixels(hotPixelSigma),
+    hasDark(false), hasFlat(false), enabled(true),
+    requested(Master::None), collecting(Master::None), collected(0),
+    combining(false), combined(false), combinedHotPixels(hotPixelSigma)
+{
+}
+
+Calibration::~Calibration()
+{
+    if (combiner.joinable())
+        combiner.join();
+}
+
+void Calibration::Resize(int newWidth, int newHeight)
+{
+    if (newWidth == width && newHeight == height)
+        return;
+    width = newWidth;
+    height = newHeight;
+    dark.assign((size_t)width * height, 0.0f);
+    gain.assign((size_t)width * height, 1.0f);
+    hotPixels.Clear();
+    hasDark = false;
+    hasFlat = false;
+}
+
+void Calibration::LoadDark(std::string const& filename)
+{
+    int fileWidth, fileHeight;
+    auto master = ReadFitsFloat(filename, fileWidth, fileHeight);
+    SetDark(std::move(master), fileWidth, fileHeight);
+}
+
+void Calibration::LoadFlat(std::string const& filename)
+{
+    int fileWidth, fileHeight;
+    auto master = ReadFitsFloat(filename, fileWidth, fileHeight);
+    SetFlat(master, fileWidth, fileHeight);
+}
+
+void Calibration::SetDark(std::vector<float> master, int masterWidth, int masterHeight)
+{
+    Resize(masterWidth, masterHeight);
+    dark = std::move(master);
+    hotPixels.Build(dark, width, height);
+    hasDark = true;
+}
+
+void Calibration::SetFlat(std::vector<float> const& flat, int masterWidth, int masterHeight)
+{
+    Resize(masterWidth, masterHeight);
+    FlatGain(flat, gain);
+    hasFlat = true;
+}
+
+void Calibration::FlatGain(std::vector<float> const& flat, std::vector<float>& gain)
+{
+    double total = 0;
+    long count = 0;
+    for (auto value : flat)
+    {
+        if (value > 0)
+        {
+            total += value;
+            count++;
+        }
+    }
+    if (count == 0)
+        throw std::runtime_error("Master flat is empty");
+    float mean = (float)(total / count);
+    // dead or vignetted-to-black pixels would blow up; leave them alone
+    gain.resize(flat.size());
+    for (size_t i = 0; i < flat.size(); i++)
+        gain[i] = flat[i] > mean * 0.05f ? mean / flat[i] : 1.0f;
+}
+
+void Calibration::Process(Frame& frame, ThreadPool& pool)
+{
+    if (combined.exchange(false))
+        Install();
+    auto request = requested.exchange(Master::None);
+    if (request != Master::None && collecting != Master::None)
+        std::cout << "Still working on the last master, request ignored" << std::endl;
+    else if (request != Master::None)
+    {
+        // the stacking buffers are only allocated when a master is started
+        size_t size = frame.size();
+        if (combine == Combine::Mean)
+            sum.reset(new float[size]);
+        else
+            stack.reset(new uint16_t[size * numFrames]);
+        collected = 0;
+        collecting = request;
+        collectWidth = frame.width;
+        collectHeight = frame.height;
+        std::cout << "Collecting " << numFrames << " frames for master "
+            << (request == Master::Dark ? "dark" : "flat") << std::endl;
+    }
+    if (collecting != Master::None && !combining)
+    {
+        if (frame.width != collectWidth || frame.height != collectHeight)
+        {
+            std::cout << "Frame size changed, master abandoned" << std::endl;
+            sum.reset();
+            stack.reset();
+            collecting = Master::None;
+        }
+        else
+        {
+            Accumulate(frame, pool);
+            if (++collected == numFrames)
+                Finish();
+        }
+    }
+    if (enabled)
+    {
+        Apply(frame.data(), frame.width, frame.height, pool);
+        // after the dark, so the replacements come from calibrated neighbours
+        hotPixels.Correct(frame.data(), frame.width, frame.height);
+    }
+}
+
+void Calibration::Accumulate(Frame const& frame, ThreadPool& pool)
+{
+    auto pixels = frame.data();
+    size_t size = frame.size();
+    if (combine == Combine::Mean)
+    {
+        bool first = collected == 0;
+        pool.ParallelRows(frame.height, 1, [&](int begin, int end)
+                {
+                for (size_t i = (size_t)begin * frame.width; i < (size_t)end * frame.width; i++)
+                    sum[i] = first ? pixels[i] : sum[i] + pixels[i];
+                });
+    }
+    else
+    {
+        std::copy(pixels, pixels + size, stack.get() + size * collected);
+    }
+}
+
+// Hands the collected frames to the combiner. Only the capture thread
+// touches the masters in use, so the result waits in combinedMaster until
+// Install picks it up.
+void Calibration::Finish()
+{
+    if (combiner.joinable())
+        combiner.join();
+    combining = true;
+    combiner = std::thread([this]() { CombineMaster(); });
+}
+
+void Calibration::CombineMaster()
+{
+    auto which = collecting.load();
+    try
+    {
+        size_t size = (size_t)collectWidth * collectHeight;
+        std::vector<float> master(size);
+        if (combine == Combine::Mean)
+        {
+            for (size_t i = 0; i < size; i++)
+                master[i] = sum[i] / numFrames;
+        }
+        else
+        {
+            // a one-off, so it can have every core for a moment
+            ThreadPool pool(0);
+            pool.ParallelRows(collectHeight, 1, [&](int begin, int end)
+                    {
+                    std::vector<uint16_t> values(numFrames);
+                    for (size_t i = (size_t)begin * collectWidth; i < (size_t)end * collectWidth; i++)
+                    {
+                        for (int k = 0; k < numFrames; k++)
+                            values[k] = stack[size * k + i];
+                        std::nth_element(values.begin(), values.begin() + numFrames / 2, values.end());
+                        master[i] = values[numFrames / 2];
+                    }
+                    });
+        }
+        sum.reset();
+        stack.reset();
+
+        if (which == Master::Dark)
+        {
+            WriteFitsFloat("master-dark.fits", master.data(), collectWidth, collectHeight);
+            combinedHotPixels.Build(master, collectWidth, collectHeight);
+            combinedMaster = std::move(master);
+        }
+        else
+        {
+            // a flat taken at another size replaces the dark as well; the
+            // dark can't change under us, as only Install replaces it
+            if (hasDark && width == collectWidth && height == collectHeight)
+                for (size_t i = 0; i < size; i++)
+                    master[i] -= dark[i];
+            WriteFitsFloat("master-flat.fits", master.data(), collectWidth, collectHeight);
+            FlatGain(master, combinedMaster);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cout << "Exception while combining master!" << std::endl;
+        std::cout << ex.what() << std::endl;
+        sum.reset();
+        stack.reset();
+        which = Master::None;
+    }
+    combinedWhich = which;
+    combined = true;
+}
+
+// Capture thread: swaps the combined master in between two frames.
+void Calibration::Install()
+{
+    combiner.join();
+    if (combinedWhich == Master::Dark)
+    {
+        Resize(collectWidth, collectHeight);
+        dark.swap(combinedMaster);
+        hotPixels.Swap(combinedHotPixels);
+        hasDark = true;
+    }
+    else if (combinedWhich == Master::Flat)
+    {
+        Resize(collectWidth, collectHeight);
+        gain.swap(combinedMaster);
+        hasFlat = true;
+    }
+    std::vector<float>().swap(combinedMaster);
+    combinedHotPixels.Clear();
+    collecting = Master::None;
+    combining = false;
+}
+
+static void ApplyScalar(uint16_t* pixels, float const* dark, float const* gain, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float value = (pixels[i] - dark[i]) * gain[i];
+        // lrint rounds half to even, like the vector conversions
+        pixels[i] = (uint16_t)std::lrint(std::min(std::max(value, 0.0f), 65535.0f));
+    }
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void ApplySse2(uint16_t* pixels, float const* dark, float const* gain, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 maxValue = _mm_set1_ps(65535.0f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+        __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero));
+        lo = _mm_mul_ps(_mm_sub_ps(lo, _mm_loadu_ps(dark + i)), _mm_loadu_ps(gain + i));
+        hi = _mm_mul_ps(_mm_sub_ps(hi, _mm_loadu_ps(dark + i + 4)), _mm_loadu_ps(gain + i + 4));
+        lo = _mm_min_ps(_mm_max_ps(lo, _mm_setzero_ps()), maxValue);
+        hi = _mm_min_ps(_mm_max_ps(hi, _mm_setzero_ps()), maxValue);
+        // SSE2 only packs signed words, so shift into that range and back
+        __m128i loInt = _mm_sub_epi32(_mm_cvtps_epi32(lo), bias);
+        __m128i hiInt = _mm_sub_epi32(_mm_cvtps_epi32(hi), bias);
+        __m128i packed = _mm_xor_si128(_mm_packs_epi32(loInt, hiInt), flip);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), packed);
+    }
+    ApplyScalar(pixels + i, dark + i, gain + i, count - i);
+}
+
+TARGET_AVX2 static void ApplyAvx2(uint16_t* pixels, float const* dark, float const* gain, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i raw = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw)));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1)));
+        lo = _mm256_mul_ps(_mm256_sub_ps(lo, _mm256_loadu_ps(dark + i)), _mm256_loadu_ps(gain + i));
+        hi = _mm256_mul_ps(_mm256_sub_ps(hi, _mm256_loadu_ps(dark + i + 8)), _mm256_loadu_ps(gain + i + 8));
+        // packus saturates to 0..65535 but works per 128-bit lane, so the
+        // quadwords need putting back in order afterwards
+        __m256i packed = _mm256_packus_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + i), packed);
+    }
+    ApplyScalar(pixels + i, dark + i, gain + i, count - i);
+}
+#endif
+
+void Calibration::Apply(uint16_t* pixels, int frameWidth, int frameHeight, ThreadPool& pool) const
+{
+    if (!(hasDark || hasFlat) || frameWidth != width || frameHeight != height)
+        return;
+    auto level = DetectSimd();
+    pool.ParallelRows(height, 16, [&](int begin, int end)
+            {
+            size_t offset = (size_t)begin * width;
+            size_t count = (size_t)(end - begin) * width;
+            switch (level)
+            {
+#if LUDISP_X86
+                case SimdLevel::Avx2:
+                    ApplyAvx2(pixels + offset, dark.data() + offset, gain.data() + offset, count);
+                    break;
+                case SimdLevel::Sse2:
+                    ApplySse2(pixels + offset, dark.data() + offset, gain.data() + offset, count);
+                    break;
+#endif
+                default:
+                    ApplyScalar(pixels + offset, dark.data() + offset, gain.data() + offset, count);
+                    break;
+            }
+            });
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framering.h"
+#include "hotpixels.h"
+#include "threadpool.h"
+
+// Dark subtraction, flat-field and hot pixel correction, applied to every
+// frame in the capture thread before it is displayed or saved. Masters are
+// either loaded from FITS or stacked from the next N live frames on request;
+// the hot pixel map comes from the dark. The capture thread only copies the
+// frames for a new master; combining and saving it happen on a thread of
+// their own, and the finished master is swapped in on a later frame.
+class Calibration
+{
+    public:
+    enum class Master
+    {
+        None,
+        Dark,
+        Flat
+    };
+
+    enum class Combine
+    {
+        Mean,
+        Median
+    };
+
+    // hotPixelSigma 0 turns off the hot pixel map.
+    Calibration(int numFrames, Combine combine, double hotPixelSigma = 8);
+    ~Calibration();
+
+    // Called from the UI thread; the capture thread starts stacking the next
+    // frame it sees.
+    void RequestMaster(Master which) { requested = which; }
+    void SetEnabled(bool on) { enabled = on; }
+    bool Enabled() const { return enabled; }
+
+    void LoadDark(std::string const& filename);
+    void LoadFlat(std::string const& filename);
+    void SetDark(std::vector<float> master, int width, int height);
+    // The flat must already have the dark subtracted.
+    void SetFlat(std::vector<float> const& master, int width, int height);
+
+    // Feeds a raw frame to a pending master and calibrates it in place.
+    void Process(Frame& frame, ThreadPool& pool);
+
+    // Applies (raw - dark) * gain in place, where gain is the normalized
+    // inverse flat. Does nothing if the masters don't match the frame size.
+    void Apply(uint16_t* pixels, int width, int height, ThreadPool& pool) const;
+
+    bool HasDark() const { return hasDark; }
+    bool HasFlat() const { return hasFlat; }
+    HotPixelMap const& HotPixels() const { return hotPixels; }
+    Master Collecting() const { return collecting; }
+    int FramesCollected() const { return collected; }
+    // All frames are in and the master is being combined.
+    bool Combining() const { return combining; }
+    int FramesPerMaster() const { return numFrames; }
+
+    private:
+    void Resize(int width, int height);
+    void Accumulate(Frame const& frame, ThreadPool& pool);
+    void Finish();
+    void CombineMaster();
+    void Install();
+    static void FlatGain(std::vector<float> const& flat, std::vector<float>& gain);
+
+    int numFrames;
+    Combine combine;
+    int width = 0;
+    int height = 0;
+    std::vector<float> dark;
+    std::vector<float> gain;
+    HotPixelMap hotPixels;
+    std::atomic<bool> hasDark;
+    std::atomic<bool> hasFlat;
+    std::atomic<bool> enabled;
+
+    std::atomic<Master> requested;
+    std::atomic<Master> collecting;
+    std::atomic<int> collected;
+    int collectWidth = 0;
+    int collectHeight = 0;
+    // Left uninitialized, so starting a master only reserves the memory and
+    // the pages are touched as frames are copied in.
+    std::unique_ptr<float[]> sum;
+    std::unique_ptr<uint16_t[]> stack;
+
+    // The combiner's result: the new dark or gain and the dark's hot pixels.
+    // Master::None if combining failed.
+    std::thread combiner;
+    std::atomic<bool> combining;
+    std::atomic<bool> combined;
+    Master combinedWhich = Master::None;
+    std::vector<float> combinedMaster;
+    HotPixelMap combinedHotPixels;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Part of the sensor to read out, in unbinned sensor pixels. A zero size
+// reads the full sensor.
+struct Readout
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    int binning = 1;
+};
+
+// A source of raw 16-bit monochrome frames. Capture drives it from its own
+// thread; none of the methods need to be thread safe.
+class Camera
+{
+    public:
+    virtual ~Camera() {}
+
+    virtual std::string Name() const = 0;
+    virtual int Width() const = 0;
+    virtual int Height() const = 0;
+
+    // Called before streaming; Width() and Height() then give the binned
+    // size of the region. Throws if the region doesn't fit the sensor.
+    // Returns false if the backend can't bin by that factor, in which case
+    // the region is read out unbinned and binning is left to the caller.
+    virtual bool SetReadout(Readout const& readout) = 0;
+
+    virtual void StartStreaming() = 0;
+    virtual void StopStreaming() = 0;
+
+    // Exposes the next frame and copies it into dest, which holds
+    // Width() * Height() pixels. Blocks until the frame is read out.
+    // Backends that expose ahead only return frames taken with the current
+    // exposure.
+    virtual void Capture(uint16_t* dest) = 0;
+
+    virtual void SetExposure(double seconds) = 0;
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "binning.h"
+#include "camera.h"
+#include "framering.h"
+#include "fitswriter.h"
+#include "lucky.h"
+#include "threadpool.h"
+#include "timing.h"
+
+// Runs the acquisition loop for a Camera: copies every frame into a pooled
+// slot, hands it to the display callback and queues it for saving.
+//
+// While nothing is being saved, the newest live frames are also kept in a
+// pre-trigger ring. An event request saves the ring and the frames after it
+// as one burst, so a meteor seen on screen is already on its way to disk.
+// The ring only holds references to pool slots set aside for it; flushing
+// moves them to the writer without copying or allocating.
+//
+// Cameras that can't bin on the sensor are read into a scratch buffer and
+// binned in software into the slot, so everything after capture works on
+// the smaller frames.
+class Capture
+{
+    Camera& camera;
+    int binning;
+    int width;
+    int height;
+    std::vector<uint16_t> raw;
+    std::vector<uint16_t> binScratch;
+    ThreadPool serial;
+    ThreadPool* binPool;
+    FramePool pool;
+    std::vector<FrameRef> ring;
+    size_t ringStart = 0;
+    std::atomic<size_t> ringCount;
+    // frames older than this are let go, in ns; 0 keeps as many as fit
+    int64_t ringSpan;
+    int eventFrames;
+    std::atomic<bool> eventRequested;
+    std::atomic<int> eventRemaining;
+    LuckySelector* selector = nullptr;
+
+    // Hands over the keepers of a finished window, or of what was seen of
+    // the last one when the burst ends.
+    void FlushSelection(FitsWriter& writer, int later)
+    {
+        selector->Flush([&](FrameRef&& frame, int left)
+                {
+                writer.Enqueue(std::move(frame), left + later);
+                });
+    }
+
+    void Remember(FrameRef&& frame)
+    {
+        while (ringCount > 0 && (ringCount == ring.size() ||
+                    (ringSpan > 0 && frame->captured - ring[ringStart]->captured > ringSpan)))
+            Forget();
+        ring[(ringStart + ringCount) % ring.size()] = std::move(frame);
+        ringCount++;
+    }
+
+    FrameRef Forget()
+    {
+        FrameRef oldest;
+        std::swap(oldest, ring[ringStart]);
+        ringStart = (ringStart + 1) % ring.size();
+        ringCount--;
+        return oldest;
+    }
+
+    void StartEvent(FitsWriter& writer)
+    {
+        if (numImagesTake > 0)
+        {
+            std::cout << "Already saving, event ignored" << std::endl;
+            return;
+        }
+        std::cout << "Saving event: " << ringCount << " frames before, "
+            << eventFrames << " after" << std::endl;
+        while (ringCount > 0)
+        {
+            auto frame = Forget();
+            writer.Enqueue(std::move(frame), (int)ringCount + eventFrames);
+        }
+        eventRemaining = eventFrames;
+    }
+
+    public:
+    // Slots handed to the display: the two queued, the one on screen, one
+    // being filled and one spare for the consumer's handover. The writer
+    // needs its own on top of that.
+    static const int numDisplaySlots = 5;
+
+    volatile int numImagesTake = 0;
+    volatile double exposureLive = 1;
+    volatile double exposureImage = 10;
+    volatile bool refreshExposure = false;
+    volatile bool closing = false;
+    volatile bool beeping = false;
+
+    // The writer's queue must have room for the whole ring on top of its
+    // usual depth; see CheckWriter. eventFrames are saved after the ring on
+    // each event.
+    // binning is the software binning factor, on top of whatever readout
+    // the camera was set to.
+    Capture(Camera& camera, int numWriterSlots, int pretriggerFrames = 0,
+            double pretriggerSeconds = 0, int eventFrames = 0, int binning = 1)
+        : camera(camera), binning(std::max(binning, 1)),
+        width(camera.Width() / this->binning), height(camera.Height() / this->binning),
+        raw(this->binning > 1 ? (size_t)camera.Width() * camera.Height() : 0),
+        binScratch(this->binning > 1 ? BinScratchSize(camera.Width(), camera.Height(), this->binning) : 0),
+        serial(1), binPool(&serial),
+        pool(numDisplaySlots + numWriterSlots + pretriggerFrames, (size_t)width * height),
+        ring(pretriggerFrames), ringCount(0), ringSpan((int64_t)(pretriggerSeconds * 1e9)),
+        eventFrames(eventFrames), eventRequested(false), eventRemaining(0)
+    {
+    }
+
+    Camera const& GetCamera() const { return camera; }
+    // Size of the frames handed out, after software binning.
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int Binning() const { return binning; }
+
+    // Threads for software binning; without them it runs on the capture
+    // thread alone. Set before StreamLoop.
+    void SetBinningPool(ThreadPool* threads) { binPool = threads ? threads : &serial; }
+
+    // Thins saved bursts to the sharpest frames while it is enabled. Set
+    // before StreamLoop; its Capacity() must be counted in numWriterSlots.
+    void SetSelector(LuckySelector* lucky) { selector = lucky; }
+    LuckySelector* Selector() const { return selector; }
+
+    // A flushed ring is enqueued in one go, so a blocking writer with less
+    // room would stall the capture thread until it drained. Throws if so;
+    // call before starting StreamLoop with that writer.
+    void CheckWriter(FitsWriter const& writer) const
+    {
+        if (writer.GetPolicy() == FitsWriter::Policy::Block && writer.MaxDepth() < ring.size())
+            throw std::runtime_error("The write queue holds " + std::to_string(writer.MaxDepth()) +
+                    " frames, fewer than the " + std::to_string(ring.size()) + " frame pre-trigger ring");
+    }
+
+    // Any thread.
+    void RequestEvent() { eventRequested = true; }
+    size_t PretriggerCapacity() const { return ring.size(); }
+    size_t PretriggerCount() const { return ringCount; }
+    int EventRemaining() const { return eventRemaining; }
+
+    template<typename Callback>
+        void StreamLoop(Callback const& callback, FitsWriter& writer)
+        {
+            camera.StartStreaming();
+            struct Raii {
+                Camera& camera;
+                Raii(Camera& camera) : camera(camera) {}
+                ~Raii()
+                {
+                    camera.StopStreaming();
+                }
+            } raii(camera);
+
+            int oldImageCount = numImagesTake;
+            unsigned long sequence = 0;
+            while (!closing)
+            {
+                // The only copy is from the driver into a pool slot that
+                // nobody else is reading, or into the binning scratch.
+                auto frame = pool.Acquire(width, height);
+                // while the writer is behind, the ring gives up its oldest
+                // frame rather than stall the live view
+                if (!frame && ringCount > 0)
+                {
+                    Forget();
+                    frame = pool.Acquire(width, height);
+                }
+                if (!frame)
+                    throw std::runtime_error("Frame pool exhausted");
+                frame->sequence = ++sequence;
+                {
+                    StageTimer timer(Timing::Stage::Capture, sequence);
+                    camera.Capture(binning > 1 ? raw.data() : frame->data());
+                }
+                if (binning > 1)
+                {
+                    StageTimer timer(Timing::Stage::Bin, sequence);
+                    Bin(raw.data(), camera.Width(), camera.Height(), binning, frame->data(), binScratch, *binPool);
+                }
+                frame->captured = Timing::Now();
+                callback(frame);
+                // a request during an event waits for it to end rather than
+                // being lost
+                if (eventRemaining == 0 && eventRequested.exchange(false))
+                    StartEvent(writer);
+                if (eventRemaining > 0)
+                {
+                    eventRemaining--;
+                    writer.Enqueue(std::move(frame), eventRemaining);
+                }
+                else if (numImagesTake > 0 && oldImageCount != 0)
+                {
+                    numImagesTake--;
+                    if (selector && selector->Enabled())
+                    {
+                        selector->Offer(std::move(frame));
+                        // the rest of the burst will be thinned the same way
+                        if (selector->WindowFull() || numImagesTake == 0)
+                            FlushSelection(writer, selector->Expected(numImagesTake));
+                    }
+                    else
+                    {
+                        // selection was turned off mid-window
+                        if (selector && selector->Held() > 0)
+                            FlushSelection(writer, numImagesTake + 1);
+                        writer.Enqueue(std::move(frame), numImagesTake);
+                    }
+                    if (numImagesTake == 0)
+                        beeping = true;
+                }
+                else if (!ring.empty() && numImagesTake == 0)
+                    Remember(std::move(frame));
+                if ((oldImageCount == 0) != (numImagesTake == 0))
+                {
+                    refreshExposure = true;
+                }
+                if (refreshExposure)
+                {
+                    refreshExposure = false;
+                    if (numImagesTake == 0)
+                        camera.SetExposure(exposureLive);
+                    else
+                        camera.SetExposure(exposureImage);
+                }
+                oldImageCount = numImagesTake;
+            }
+            std::cout << "Camera thread shut down" << std::endl;
+        }
+};
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <stdexcept>
+#include "demosaic.h"
+
+enum Channel
+{
+    Red,
+    Green,
+    Blue
+};
+
+// Channel of each pattern's top left 2x2 block, row by row.
+static const Channel layouts[][4] = {
+    { Green, Green, Green, Green }, // None
+    { Red, Green, Green, Blue },
+    { Blue, Green, Green, Red },
+    { Green, Red, Blue, Green },
+    { Green, Blue, Red, Green }
+};
+
+static Channel ChannelAt(CfaPattern pattern, int x, int y)
+{
+    return layouts[(int)pattern][(y & 1) * 2 + (x & 1)];
+}
+
+CfaPattern ParseCfa(std::string const& name)
+{
+    if (name == "none" || name == "mono")
+        return CfaPattern::None;
+    if (name == "rggb")
+        return CfaPattern::Rggb;
+    if (name == "bggr")
+        return CfaPattern::Bggr;
+    if (name == "grbg")
+        return CfaPattern::Grbg;
+    if (name == "gbrg")
+        return CfaPattern::Gbrg;
+    throw std::runtime_error("Unknown colour filter pattern " + name);
+}
+
+char const* CfaName(CfaPattern pattern)
+{
+    switch (pattern)
+    {
+        case CfaPattern::Rggb:
+            return "RGGB";
+        case CfaPattern::Bggr:
+            return "BGGR";
+        case CfaPattern::Grbg:
+            return "GRBG";
+        case CfaPattern::Gbrg:
+            return "GBRG";
+        default:
+            return "mono";
+    }
+}
+
+CfaPattern ShiftCfa(CfaPattern pattern, int dx, int dy)
+{
+    if (pattern == CfaPattern::None)
+        return pattern;
+    CfaPattern shifted[] = { CfaPattern::Rggb, CfaPattern::Bggr, CfaPattern::Grbg, CfaPattern::Gbrg };
+    for (auto candidate : shifted)
+    {
+        bool same = true;
+        for (int i = 0; i < 4; i++)
+            same = same && ChannelAt(candidate, i & 1, i >> 1) == ChannelAt(pattern, dx + (i & 1), dy + (i >> 1));
+        if (same)
+            return candidate;
+    }
+    return pattern;
+}
+
+// Mirrors an index that is up to two past either end back into [0, size).
+static int Reflect(int i, int size)
+{
+    if (i < 0)
+        return -i;
+    if (i >= size)
+        return 2 * (size - 1) - i;
+    return i;
+}
+
+// Where one row's two channels land. Every Bayer row alternates green with
+// one other colour, "own"; the third colour, "other", is only found in the
+// rows above and below. nonGreen is the parity of the columns holding own.
+struct RowLayout
+{
+    int nonGreen;
+    Channel own;
+};
+
+static RowLayout LayoutOf(CfaPattern pattern, int y)
+{
+    RowLayout layout;
+    layout.nonGreen = ChannelAt(pattern, 0, y) == Green ? 1 : 0;
+    layout.own = ChannelAt(pattern, layout.nonGreen, y);
+    return layout;
+}
+
+// Rounds up like _mm_avg_epu16.
+static inline uint16_t Avg(uint16_t a, uint16_t b)
+{
+    return (uint16_t)((a + b + 1) >> 1);
+}
+
+// Bilinear estimates of one pixel: at a non-green site own is the pixel,
+// green the average of its four neighbours and other the average of its
+// diagonals. At a green site own comes from left and right, other from
+// above and below. The outputs start at column x0.
+static void BilinearScalar(uint16_t const* up, uint16_t const* row, uint16_t const* down,
+        int width, int nonGreen, int x0, int x1, uint16_t* own, uint16_t* green, uint16_t* other)
+{
+    for (int x = x0; x < x1; x++, own++, green++, other++)
+    {
+        int left = Reflect(x - 1, width);
+        int right = Reflect(x + 1, width);
+        uint16_t h = Avg(row[left], row[right]);
+        uint16_t v = Avg(up[x], down[x]);
+        if ((x & 1) == nonGreen)
+        {
+            *own = row[x];
+            *green = Avg(h, v);
+            *other = Avg(Avg(up[left], up[right]), Avg(down[left], down[right]));
+        }
+        else
+        {
+            *own = h;
+            *green = row[x];
+            *other = v;
+        }
+    }
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static inline __m128i Load(uint16_t const* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+}
+
+TARGET_SSE2 static inline __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+TARGET_AVX2 static inline __m256i Load256(uint16_t const* p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+}
+
+// Computes every estimate for 8 pixels and picks per lane with a mask of
+// the non-green columns. Only for columns that have both neighbours.
+TARGET_SSE2 static void BilinearSse2(uint16_t const* up, uint16_t const* row, uint16_t const* down,
+        int width, int nonGreen, int x0, int x1, uint16_t* own, uint16_t* green, uint16_t* other)
+{
+    int x = x0;
+    // lanes alternate colour, so the mask is fixed once x0's parity is
+    const __m128i site = _mm_set1_epi32((x0 & 1) == nonGreen ? 0x0000FFFF : (int)0xFFFF0000);
+    for (; x + 8 <= x1; x += 8)
+    {
+        __m128i c = Load(row + x);
+        __m128i h = _mm_avg_epu16(Load(row + x - 1), Load(row + x + 1));
+        __m128i v = _mm_avg_epu16(Load(up + x), Load(down + x));
+        __m128i cross = _mm_avg_epu16(h, v);
+        __m128i diagonal = _mm_avg_epu16(_mm_avg_epu16(Load(up + x - 1), Load(up + x + 1)),
+                _mm_avg_epu16(Load(down + x - 1), Load(down + x + 1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(own + x - x0), Select(site, c, h));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(green + x - x0), Select(site, cross, c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(other + x - x0), Select(site, diagonal, v));
+    }
+    BilinearScalar(up, row, down, width, nonGreen, x, x1, own + x - x0, green + x - x0, other + x - x0);
+}
+
+TARGET_AVX2 static void BilinearAvx2(uint16_t const* up, uint16_t const* row, uint16_t const* down,
+        int width, int nonGreen, int x0, int x1, uint16_t* own, uint16_t* green, uint16_t* other)
+{
+    int x = x0;
+    const __m256i site = _mm256_set1_epi32((x0 & 1) == nonGreen ? 0x0000FFFF : (int)0xFFFF0000);
+    for (; x + 16 <= x1; x += 16)
+    {
+        __m256i c = Load256(row + x);
+        __m256i h = _mm256_avg_epu16(Load256(row + x - 1), Load256(row + x + 1));
+        __m256i v = _mm256_avg_epu16(Load256(up + x), Load256(down + x));
+        __m256i cross = _mm256_avg_epu16(h, v);
+        __m256i diagonal = _mm256_avg_epu16(_mm256_avg_epu16(Load256(up + x - 1), Load256(up + x + 1)),
+                _mm256_avg_epu16(Load256(down + x - 1), Load256(down + x + 1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(own + x - x0), _mm256_blendv_epi8(h, c, site));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(green + x - x0), _mm256_blendv_epi8(c, cross, site));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(other + x - x0), _mm256_blendv_epi8(v, diagonal, site));
+    }
+    BilinearScalar(up, row, down, width, nonGreen, x, x1, own + x - x0, green + x - x0, other + x - x0);
+}
+#endif
+
+void DemosaicRow(uint16_t const* src, int width, int height, CfaPattern pattern, int y, int x0, int x1,
+        uint16_t* red, uint16_t* green, uint16_t* blue, SimdLevel level)
+{
+    if (width < 2 || height < 2)
+        throw std::runtime_error("Demosaicing needs at least 2x2 pixels");
+    if (pattern == CfaPattern::None)
+        throw std::runtime_error("Demosaicing needs a colour filter pattern");
+    auto row = src + (size_t)y * width;
+    auto up = src + (size_t)Reflect(y - 1, height) * width;
+    auto down = src + (size_t)Reflect(y + 1, height) * width;
+    auto layout = LayoutOf(pattern, y);
+    auto own = layout.own == Red ? red : blue;
+    auto other = layout.own == Red ? blue : red;
+    // the vector kernels need a column on either side: [x0, a) and [b, x1)
+    // are done in scalar code
+    int a = std::min(std::max(x0, 1), x1);
+    int b = std::max(std::min(x1, width - 1), a);
+    BilinearScalar(up, row, down, width, layout.nonGreen, x0, a, own, green, other);
+    own += a - x0;
+    green += a - x0;
+    other += a - x0;
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            BilinearAvx2(up, row, down, width, layout.nonGreen, a, b, own, green, other);
+            break;
+        case SimdLevel::Sse2:
+            BilinearSse2(up, row, down, width, layout.nonGreen, a, b, own, green, other);
+            break;
+#endif
+        default:
+            BilinearScalar(up, row, down, width, layout.nonGreen, a, b, own, green, other);
+            break;
+    }
+    BilinearScalar(up, row, down, width, layout.nonGreen, b, x1, own + (b - a), green + (b - a), other + (b - a));
+}
+
+// Malvar-He-Cutler 5x5 filters, written as sums of symmetric taps around
+// the pixel so each is a few multiply-adds:
+//   c   the pixel itself
+//   h1  left + right,        v1  up + down
+//   h2  two left + two right, v2  two up + two down
+//   d   the four diagonals
+struct Taps
+{
+    float const* rows[5];
+    int width;
+
+    float At(int row, int x) const { return rows[row][Reflect(x, width)]; }
+};
+
+static void QualityScalar(Taps const& taps, int nonGreen, int x0, int x1,
+        float* own, float* green, float* other)
+{
+    for (int x = x0; x < x1; x++)
+    {
+        float c = taps.At(2, x);
+        float h1 = taps.At(2, x - 1) + taps.At(2, x + 1);
+        float v1 = taps.At(1, x) + taps.At(3, x);
+        float h2 = taps.At(2, x - 2) + taps.At(2, x + 2);
+        float v2 = taps.At(0, x) + taps.At(4, x);
+        float d = (taps.At(1, x - 1) + taps.At(1, x + 1)) + (taps.At(3, x - 1) + taps.At(3, x + 1));
+        if ((x & 1) == nonGreen)
+        {
+            own[x] = c;
+            green[x] = (4 * c + 2 * (h1 + v1) - (h2 + v2)) * 0.125f;
+            other[x] = (6 * c + 2 * d - 1.5f * (h2 + v2)) * 0.125f;
+        }
+        else
+        {
+            own[x] = (5 * c + 4 * h1 - d - h2 + 0.5f * v2) * 0.125f;
+            green[x] = c;
+            other[x] = (5 * c + 4 * v1 - d - v2 + 0.5f * h2) * 0.125f;
+        }
+    }
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void QualitySse2(Taps const& taps, int nonGreen, int x0, int x1,
+        float* own, float* green, float* other)
+{
+    auto r0 = taps.rows[0];
+    auto r1 = taps.rows[1];
+    auto r2 = taps.rows[2];
+    auto r3 = taps.rows[3];
+    auto r4 = taps.rows[4];
+    const __m128 site = (x0 & 1) == nonGreen
+        ? _mm_castsi128_ps(_mm_set_epi32(0, -1, 0, -1))
+        : _mm_castsi128_ps(_mm_set_epi32(-1, 0, -1, 0));
+    const __m128 two = _mm_set1_ps(2);
+    const __m128 four = _mm_set1_ps(4);
+    const __m128 five = _mm_set1_ps(5);
+    const __m128 six = _mm_set1_ps(6);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threeHalves = _mm_set1_ps(1.5f);
+    const __m128 eighth = _mm_set1_ps(0.125f);
+    int x = x0;
+    for (; x + 4 <= x1; x += 4)
+    {
+        __m128 c = _mm_loadu_ps(r2 + x);
+        __m128 h1 = _mm_add_ps(_mm_loadu_ps(r2 + x - 1), _mm_loadu_ps(r2 + x + 1));
+        __m128 v1 = _mm_add_ps(_mm_loadu_ps(r1 + x), _mm_loadu_ps(r3 + x));
+        __m128 h2 = _mm_add_ps(_mm_loadu_ps(r2 + x - 2), _mm_loadu_ps(r2 + x + 2));
+        __m128 v2 = _mm_add_ps(_mm_loadu_ps(r0 + x), _mm_loadu_ps(r4 + x));
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(r1 + x - 1), _mm_loadu_ps(r1 + x + 1)),
+                _mm_add_ps(_mm_loadu_ps(r3 + x - 1), _mm_loadu_ps(r3 + x + 1)));
+        __m128 g = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(four, c), _mm_mul_ps(two, _mm_add_ps(h1, v1))),
+                    _mm_add_ps(h2, v2)), eighth);
+        __m128 diagonal = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(six, c), _mm_mul_ps(two, d)),
+                    _mm_mul_ps(threeHalves, _mm_add_ps(h2, v2))), eighth);
+        __m128 horizontal = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(
+                            _mm_add_ps(_mm_mul_ps(five, c), _mm_mul_ps(four, h1)), d), h2),
+                    _mm_mul_ps(half, v2)), eighth);
+        __m128 vertical = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(
+                            _mm_add_ps(_mm_mul_ps(five, c), _mm_mul_ps(four, v1)), d), v2),
+                    _mm_mul_ps(half, h2)), eighth);
+        _mm_storeu_ps(own + x, _mm_or_ps(_mm_and_ps(site, c), _mm_andnot_ps(site, horizontal)));
+        _mm_storeu_ps(green + x, _mm_or_ps(_mm_and_ps(site, g), _mm_andnot_ps(site, c)));
+        _mm_storeu_ps(other + x, _mm_or_ps(_mm_and_ps(site, diagonal), _mm_andnot_ps(site, vertical)));
+    }
+    QualityScalar(taps, nonGreen, x, x1, own, green, other);
+}
+
+TARGET_AVX2 static void QualityAvx2(Taps const& taps, int nonGreen, int x0, int x1,
+        float* own, float* green, float* other)
+{
+    auto r0 = taps.rows[0];
+    auto r1 = taps.rows[1];
+    auto r2 = taps.rows[2];
+    auto r3 = taps.rows[3];
+    auto r4 = taps.rows[4];
+    const __m256 site = (x0 & 1) == nonGreen
+        ? _mm256_castsi256_ps(_mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0))
+        : _mm256_castsi256_ps(_mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+    const __m256 two = _mm256_set1_ps(2);
+    const __m256 four = _mm256_set1_ps(4);
+    const __m256 five = _mm256_set1_ps(5);
+    const __m256 six = _mm256_set1_ps(6);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    const __m256 eighth = _mm256_set1_ps(0.125f);
+    int x = x0;
+    for (; x + 8 <= x1; x += 8)
+    {
+        __m256 c = _mm256_loadu_ps(r2 + x);
+        __m256 h1 = _mm256_add_ps(_mm256_loadu_ps(r2 + x - 1), _mm256_loadu_ps(r2 + x + 1));
+        __m256 v1 = _mm256_add_ps(_mm256_loadu_ps(r1 + x), _mm256_loadu_ps(r3 + x));
+        __m256 h2 = _mm256_add_ps(_mm256_loadu_ps(r2 + x - 2), _mm256_loadu_ps(r2 + x + 2));
+        __m256 v2 = _mm256_add_ps(_mm256_loadu_ps(r0 + x), _mm256_loadu_ps(r4 + x));
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(r1 + x - 1), _mm256_loadu_ps(r1 + x + 1)),
+                _mm256_add_ps(_mm256_loadu_ps(r3 + x - 1), _mm256_loadu_ps(r3 + x + 1)));
+        __m256 g = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(four, c),
+                        _mm256_mul_ps(two, _mm256_add_ps(h1, v1))), _mm256_add_ps(h2, v2)), eighth);
+        __m256 diagonal = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(six, c), _mm256_mul_ps(two, d)),
+                    _mm256_mul_ps(threeHalves, _mm256_add_ps(h2, v2))), eighth);
+        __m256 horizontal = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(
+                            _mm256_add_ps(_mm256_mul_ps(five, c), _mm256_mul_ps(four, h1)), d), h2),
+                    _mm256_mul_ps(half, v2)), eighth);
+        __m256 vertical = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(
+                            _mm256_add_ps(_mm256_mul_ps(five, c), _mm256_mul_ps(four, v1)), d), v2),
+                    _mm256_mul_ps(half, h2)), eighth);
+        _mm256_storeu_ps(own + x, _mm256_blendv_ps(horizontal, c, site));
+        _mm256_storeu_ps(green + x, _mm256_blendv_ps(c, g, site));
+        _mm256_storeu_ps(other + x, _mm256_blendv_ps(vertical, diagonal, site));
+    }
+    QualityScalar(taps, nonGreen, x, x1, own, green, other);
+}
+#endif
+
+void Demosaic(float const* src, int width, int height, CfaPattern pattern, float* dest,
+        ThreadPool& pool, SimdLevel level)
+{
+    if (width < 3 || height < 3)
+        throw std::runtime_error("Demosaicing needs at least 3x3 pixels");
+    if (pattern == CfaPattern::None)
+        throw std::runtime_error("Demosaicing needs a colour filter pattern");
+    size_t planeSize = (size_t)width * height;
+    pool.ParallelRows(height, 8, [&](int begin, int end)
+            {
+            for (int y = begin; y < end; y++)
+            {
+                Taps taps;
+                taps.width = width;
+                for (int k = 0; k < 5; k++)
+                    taps.rows[k] = src + (size_t)Reflect(y + k - 2, height) * width;
+                auto layout = LayoutOf(pattern, y);
+                size_t offset = (size_t)y * width;
+                auto ownPlane = layout.own == Red ? 0 : 2;
+                auto own = dest + ownPlane * planeSize + offset;
+                auto green = dest + planeSize + offset;
+                auto other = dest + (2 - ownPlane) * planeSize + offset;
+                // two columns at either edge are mirrored; the rest are
+                // read straight from the rows
+                int inner1 = std::max(width - 2, 2);
+                QualityScalar(taps, layout.nonGreen, 0, 2, own, green, other);
+                switch (level)
+                {
+#if LUDISP_X86
+                    case SimdLevel::Avx2:
+                        QualityAvx2(taps, layout.nonGreen, 2, inner1, own, green, other);
+                        break;
+                    case SimdLevel::Sse2:
+                        QualitySse2(taps, layout.nonGreen, 2, inner1, own, green, other);
+                        break;
+#endif
+                    default:
+                        QualityScalar(taps, layout.nonGreen, 2, inner1, own, green, other);
+                        break;
+                }
+                QualityScalar(taps, layout.nonGreen, inner1, width, own, green, other);
+            }
+            });
+}
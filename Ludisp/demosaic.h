@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "simd.h"
+#include "threadpool.h"
+
+// Colour filter array layout, named by the colours of the top left 2x2
+// block read row by row.
+enum class CfaPattern
+{
+    None,
+    Rggb,
+    Bggr,
+    Grbg,
+    Gbrg
+};
+
+// Parses "rggb" and the like; "none" or "mono" for a monochrome sensor.
+CfaPattern ParseCfa(std::string const& name);
+char const* CfaName(CfaPattern pattern);
+// The pattern seen by a region starting dx, dy pixels into the sensor.
+CfaPattern ShiftCfa(CfaPattern pattern, int dx, int dy);
+
+// Live view path: bilinear interpolation of columns [x0, x1) of row y into
+// separate red, green and blue rows, so the display only pays for the rows
+// it shows. Neighbours past the frame edge are mirrored, which keeps their
+// colour. Needs a frame of at least 2x2.
+void DemosaicRow(uint16_t const* src, int width, int height, CfaPattern pattern, int y, int x0, int x1,
+        uint16_t* red, uint16_t* green, uint16_t* blue, SimdLevel level);
+
+inline void DemosaicRow(uint16_t const* src, int width, int height, CfaPattern pattern, int y, int x0, int x1,
+        uint16_t* red, uint16_t* green, uint16_t* blue)
+{
+    DemosaicRow(src, width, height, pattern, y, x0, x1, red, green, blue, DetectSimd());
+}
+
+// Quality path for saved output: Malvar-He-Cutler gradient-corrected
+// interpolation, which adds a scaled Laplacian of the known channel to the
+// bilinear estimate and so keeps most of the edges bilinear blurs. dest
+// holds three planes of width * height, red, green then blue. Values are not
+// clamped; a bright edge can overshoot a little as with any sharpening.
+void Demosaic(float const* src, int width, int height, CfaPattern pattern, float* dest,
+        ThreadPool& pool, SimdLevel level);
+
+inline void Demosaic(float const* src, int width, int height, CfaPattern pattern, float* dest,
+        ThreadPool& pool)
+{
+    Demosaic(src, width, height, pattern, dest, pool, DetectSimd());
+}
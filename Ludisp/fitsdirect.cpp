@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "fitsdirect.h"
+
+static const size_t blockSize = 2880;
+static const size_t cardSize = 80;
+// Pixels converted per write: 256 KB, small enough to stay in L2.
+static const size_t chunkPixels = 128 * 1024;
+
+// Swapping puts the sign bit of the stored value in the low byte, so writing
+// flips 0x0080 after the swap and reading flips 0x8000.
+static const uint16_t toFitsFlip = 0x0080;
+static const uint16_t fromFitsFlip = 0x8000;
+
+static void SwapScalar(uint16_t const* src, uint16_t* dst, size_t count, uint16_t flip)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = (uint16_t)((src[i] << 8 | src[i] >> 8) ^ flip);
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void SwapSse2(uint16_t const* src, uint16_t* dst, size_t count, uint16_t flip)
+{
+    const __m128i flips = _mm_set1_epi16((short)flip);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(x, flips));
+    }
+    SwapScalar(src + i, dst + i, count - i, flip);
+}
+
+TARGET_AVX2 static void SwapAvx2(uint16_t const* src, uint16_t* dst, size_t count, uint16_t flip)
+{
+    const __m256i swap = _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256i flips = _mm256_set1_epi16((short)flip);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+        x = _mm256_shuffle_epi8(x, swap);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(x, flips));
+    }
+    SwapScalar(src + i, dst + i, count - i, flip);
+}
+#endif
+
+static void Swap(uint16_t const* src, uint16_t* dst, size_t count, uint16_t flip, SimdLevel level)
+{
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            SwapAvx2(src, dst, count, flip);
+            break;
+        case SimdLevel::Sse2:
+            SwapSse2(src, dst, count, flip);
+            break;
+#endif
+        default:
+            SwapScalar(src, dst, count, flip);
+            break;
+    }
+}
+
+void ToFitsOrder(uint16_t const* src, uint16_t* dst, size_t count, SimdLevel level)
+{
+    Swap(src, dst, count, toFitsFlip, level);
+}
+
+void FromFitsOrder(uint16_t const* src, uint16_t* dst, size_t count, SimdLevel level)
+{
+    Swap(src, dst, count, fromFitsFlip, level);
+}
+
+static void AddCard(std::string& header, std::string const& keyword, std::string const& value)
+{
+    char card[cardSize + 1];
+    snprintf(card, sizeof(card), "%-8s= %20s", keyword.c_str(), value.c_str());
+    header += card;
+    header.resize(header.size() + cardSize - strlen(card), ' ');
+}
+
+// pwritev until everything is out, picking up after short writes.
+static void WriteAll(int fd, iovec* iov, int count, off_t offset, std::string const& filename)
+{
+    while (count > 0)
+    {
+        auto written = pwritev(fd, iov, count, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Could not write " + filename + ": " + strerror(errno));
+        }
+        offset += written;
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+void WriteFitsDirect(std::string const& filename, uint16_t const* pixels, int width, int height)
+{
+    std::string header;
+    AddCard(header, "SIMPLE", "T");
+    AddCard(header, "BITPIX", "16");
+    AddCard(header, "NAXIS", "2");
+    AddCard(header, "NAXIS1", std::to_string(width));
+    AddCard(header, "NAXIS2", std::to_string(height));
+    AddCard(header, "BZERO", "32768");
+    AddCard(header, "BSCALE", "1");
+    header += "END";
+    header.resize(blockSize, ' ');
+
+    size_t size = (size_t)width * height;
+    static const char zeros[blockSize] = {};
+    size_t padding = (blockSize - size * sizeof(uint16_t) % blockSize) % blockSize;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Could not create " + filename + ": " + strerror(errno));
+    thread_local std::vector<uint16_t> scratch(chunkPixels);
+    try
+    {
+        off_t offset = 0;
+        size_t done = 0;
+        // The header rides along with the first chunk and the padding
+        // with the last, so a small frame is a single syscall.
+        do
+        {
+            size_t count = std::min(chunkPixels, size - done);
+            ToFitsOrder(pixels + done, scratch.data(), count);
+            iovec iov[3];
+            int numIov = 0;
+            if (done == 0)
+                iov[numIov++] = { const_cast<char*>(header.data()), header.size() };
+            iov[numIov++] = { scratch.data(), count * sizeof(uint16_t) };
+            if (done + count == size && padding > 0)
+                iov[numIov++] = { const_cast<char*>(zeros), padding };
+            size_t bytes = 0;
+            for (int i = 0; i < numIov; i++)
+                bytes += iov[i].iov_len;
+            WriteAll(fd, iov, numIov, offset, filename);
+            offset += bytes;
+            done += count;
+        } while (done < size);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    if (close(fd) != 0)
+        throw std::runtime_error("Could not write " + filename + ": " + strerror(errno));
+}
+
+MappedFits::MappedFits(std::string const& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Could not open " + filename + ": " + strerror(errno));
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Could not stat " + filename + ": " + strerror(errno));
+    }
+    length = info.st_size;
+    map = length > 0 ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        map = nullptr;
+        throw std::runtime_error("Could not map " + filename + ": " + strerror(errno));
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+
+    // Walk the primary header. Anything beyond a plain unsigned 2D image
+    // (compression, scaling, other bit depths) is left to cfitsio.
+    auto bytes = static_cast<char const*>(map);
+    bool simple = false;
+    long bitpix = 0, naxis = 0, naxis1 = 0, naxis2 = 0;
+    double bzero = 0, bscale = 1;
+    size_t offset = 0;
+    bool end = false;
+    for (; offset + cardSize <= length && !end; offset += cardSize)
+    {
+        std::string card(bytes + offset, cardSize);
+        auto keyword = card.substr(0, 8);
+        keyword.erase(keyword.find_last_not_of(' ') + 1);
+        if (keyword == "END")
+            end = true;
+        if (card.compare(8, 2, "= ") != 0)
+            continue;
+        auto value = card.substr(10);
+        if (keyword == "SIMPLE")
+            simple = value.find('T') < value.find('/');
+        else if (keyword == "BITPIX")
+            bitpix = strtol(value.c_str(), nullptr, 10);
+        else if (keyword == "NAXIS")
+            naxis = strtol(value.c_str(), nullptr, 10);
+        else if (keyword == "NAXIS1")
+            naxis1 = strtol(value.c_str(), nullptr, 10);
+        else if (keyword == "NAXIS2")
+            naxis2 = strtol(value.c_str(), nullptr, 10);
+        else if (keyword == "BZERO")
+            bzero = strtod(value.c_str(), nullptr);
+        else if (keyword == "BSCALE")
+            bscale = strtod(value.c_str(), nullptr);
+    }
+    size_t dataOffset = (offset + blockSize - 1) / blockSize * blockSize;
+    size_t dataSize = (size_t)naxis1 * naxis2 * sizeof(uint16_t);
+    if (end && simple && bitpix == 16 && naxis == 2 && naxis1 > 0 && naxis2 > 0 &&
+            bzero == 32768 && bscale == 1 && dataOffset + dataSize <= length)
+    {
+        width = naxis1;
+        height = naxis2;
+        pixels = reinterpret_cast<uint16_t const*>(bytes + dataOffset);
+    }
+    else
+    {
+        munmap(map, length);
+        map = nullptr;
+    }
+}
+
+MappedFits::~MappedFits()
+{
+    if (map)
+        munmap(map, length);
+}
+
+void MappedFits::Read(uint16_t* dest) const
+{
+    if (!pixels)
+        throw std::runtime_error("Not a plain 16-bit FITS image");
+    FromFitsOrder(pixels, dest, (size_t)width * height);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "simd.h"
+
+// Uncompressed 16-bit 2D FITS without cfitsio. FITS stores unsigned pixels
+// as big-endian signed values with BZERO = 32768, so going either way is a
+// byte swap and a sign flip, done in one vector pass.
+
+// Native pixels to the on-disk layout.
+void ToFitsOrder(uint16_t const* src, uint16_t* dst, size_t count, SimdLevel level);
+inline void ToFitsOrder(uint16_t const* src, uint16_t* dst, size_t count)
+{
+    ToFitsOrder(src, dst, count, DetectSimd());
+}
+
+// On-disk layout back to native pixels.
+void FromFitsOrder(uint16_t const* src, uint16_t* dst, size_t count, SimdLevel level);
+inline void FromFitsOrder(uint16_t const* src, uint16_t* dst, size_t count)
+{
+    FromFitsOrder(src, dst, count, DetectSimd());
+}
+
+// Writes the header itself and streams the converted pixels out with
+// positioned writes, a cache-sized chunk at a time.
+void WriteFitsDirect(std::string const& filename, uint16_t const* pixels, int width, int height);
+
+// Maps a FITS file read-only. If it is a plain uncompressed 16-bit 2D image,
+// Read converts the pixels straight out of the page cache; anything else
+// reports !Supported() and has to go through cfitsio.
+class MappedFits
+{
+    public:
+    explicit MappedFits(std::string const& filename);
+    ~MappedFits();
+    MappedFits(MappedFits const&) = delete;
+    MappedFits& operator=(MappedFits const&) = delete;
+
+    bool Supported() const { return pixels != nullptr; }
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    void Read(uint16_t* dest) const;
+
+    private:
+    void* map = nullptr;
+    size_t length = 0;
+    uint16_t const* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+};
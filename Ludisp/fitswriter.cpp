@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fitsio.h>
+#include "fitsdirect.h"
+#include "fitswriter.h"
+#include "timing.h"
+
+std::runtime_error error(int status)
+{
+    return std::runtime_error(std::string("FITS file library error: code ") + std::to_string(status));
+}
+
+void WriteFits(std::string filename, uint16_t const* pixels, long size, int width)
+{
+    // plain 16-bit images skip cfitsio and its buffer copies
+    WriteFitsDirect(filename, pixels, width, (int)(size / width));
+    std::cout << "Saved " << filename << std::endl;
+}
+
+// Picks <kind>-<local time><extension>, adding .1, .2, ... if that is taken.
+// The name is reserved by creating the file, so writer threads racing within
+// the same second never pick the same one.
+static std::string UniqueName(std::string const& kind, std::string const& extension)
+{
+    time_t rawtime;
+    time(&rawtime);
+    auto timeinfo = localtime(&rawtime);
+    char buffer[100];
+    std::strftime(buffer, 100, "%Y-%m-%d_%I-%M-%S", timeinfo);
+    auto prefix = kind + "-" + std::string(buffer);
+
+    for (int i = 0; ; i++)
+    {
+        auto file = i == 0 ? prefix + extension : prefix + "." + std::to_string(i) + extension;
+        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0)
+        {
+            close(fd);
+            return file;
+        }
+        if (errno != EEXIST)
+            throw std::runtime_error("Could not create " + file + ": " + strerror(errno));
+    }
+}
+
+void WriteFits(uint16_t const* pixels, long size, int width)
+{
+    WriteFits(UniqueName("image", ".fits"), pixels, size, width);
+}
+
+static int CompressionType(FitsCompression compression)
+{
+    return compression == FitsCompression::Hcompress ? HCOMPRESS_1 : RICE_1;
+}
+
+void WriteFitsCompressed(std::string filename, uint16_t const* pixels, int width, int height,
+        FitsCompression compression)
+{
+    fitsfile* file = nullptr;
+    int status = 0;
+    // the leading ! lets cfitsio overwrite the reserved empty file
+    if (fits_create_file(&file, ("!" + filename).c_str(), &status))
+        throw error(status);
+    // default tiles: one row for Rice, 16 rows for HCOMPRESS, whose
+    // default scale of zero keeps it lossless
+    if (fits_set_compression_type(file, CompressionType(compression), &status))
+        throw error(status);
+    long axes[] = { width, height };
+    if (fits_create_img(file, USHORT_IMG, 2, axes, &status))
+        throw error(status);
+    long firstpix[] = { 1, 1 };
+    if (fits_write_pix(file, TUSHORT, firstpix, (long)width * height, const_cast<uint16_t*>(pixels), &status))
+        throw error(status);
+    if (fits_close_file(file, &status))
+        throw error(status);
+}
+
+void WriteFitsFloat(std::string filename, float const* pixels, int width, int height, int planes)
+{
+    fitsfile* file = nullptr;
+    int status = 0;
+    remove(filename.c_str());
+    if (fits_create_file(&file, filename.c_str(), &status))
+        throw error(status);
+    long axes[] = { width, height, planes };
+    if (fits_create_img(file, FLOAT_IMG, planes > 1 ? 3 : 2, axes, &status))
+        throw error(status);
+    long firstpix[] = { 1, 1, 1 };
+    if (fits_write_pix(file, TFLOAT, firstpix, (long)width * height * planes, const_cast<float*>(pixels), &status))
+        throw error(status);
+    if (fits_close_file(file, &status))
+        throw error(status);
+    std::cout << "Saved " << filename << std::endl;
+}
+
+std::vector<float> ReadFitsFloat(std::string filename, int& width, int& height)
+{
+    fitsfile* file = nullptr;
+    int status = 0;
+    if (fits_open_file(&file, filename.c_str(), READONLY, &status))
+        throw error(status);
+    int bitpix, naxis;
+    long axes[2] = { 0, 0 };
+    if (fits_get_img_param(file, 2, &bitpix, &naxis, axes, &status))
+        throw error(status);
+    if (naxis != 2)
+        throw std::runtime_error(filename + " is not a 2D image");
+    width = axes[0];
+    height = axes[1];
+    std::vector<float> pixels((size_t)width * height);
+    long firstpix[] = { 1, 1 };
+    int anynul = 0;
+    if (fits_read_pix(file, TFLOAT, firstpix, (long)pixels.size(), nullptr, pixels.data(), &anynul, &status))
+        throw error(status);
+    if (fits_close_file(file, &status))
+        throw error(status);
+    return pixels;
+}
+
+// One open file that a whole burst is appended to.
+class BurstFile
+{
+    public:
+    BurstFile(std::string name, int width, int height)
+        : name(name), width(width), height(height)
+    {
+    }
+    virtual ~BurstFile() {}
+
+    virtual void Write(uint16_t const* pixels) = 0;
+
+    bool Fits(Frame const& frame) const { return frame.width == width && frame.height == height; }
+    std::string const& Name() const { return name; }
+    long Count() const { return count; }
+
+    protected:
+    std::string name;
+    int width;
+    int height;
+    long count = 0;
+};
+
+// A single NAXIS3 image. The third axis is allocated for the expected burst
+// length up front, doubled if the burst runs long and trimmed on close, so
+// cfitsio only rewrites the header twice at most.
+class CubeFile : public BurstFile
+{
+    fitsfile* file = nullptr;
+    long capacity;
+
+    public:
+    CubeFile(std::string name, int width, int height, long expected)
+        : BurstFile(name, width, height), capacity(std::max(expected, 1L))
+    {
+        int status = 0;
+        if (fits_create_file(&file, ("!" + name).c_str(), &status))
+            throw error(status);
+        long axes[] = { width, height, capacity };
+        if (fits_create_img(file, USHORT_IMG, 3, axes, &status))
+            throw error(status);
+    }
+
+    ~CubeFile()
+    {
+        int status = 0;
+        long axes[] = { width, height, count };
+        if (count != capacity)
+            fits_resize_img(file, USHORT_IMG, 3, axes, &status);
+        fits_close_file(file, &status);
+        if (status)
+            std::cout << "Error closing " << name << ": code " << status << std::endl;
+    }
+
+    void Write(uint16_t const* pixels) override
+    {
+        int status = 0;
+        if (count == capacity)
+        {
+            capacity *= 2;
+            long axes[] = { width, height, capacity };
+            if (fits_resize_img(file, USHORT_IMG, 3, axes, &status))
+                throw error(status);
+        }
+        long firstpix[] = { 1, 1, count + 1 };
+        if (fits_write_pix(file, TUSHORT, firstpix, (long)width * height,
+                    const_cast<uint16_t*>(pixels), &status))
+            throw error(status);
+        count++;
+    }
+};
+
+// A primary image followed by one IMAGE extension per further frame. With
+// compression every frame is its own tile-compressed extension instead.
+class ExtensionFile : public BurstFile
+{
+    fitsfile* file = nullptr;
+
+    public:
+    ExtensionFile(std::string name, int width, int height, FitsCompression compression)
+        : BurstFile(name, width, height)
+    {
+        int status = 0;
+        if (fits_create_file(&file, ("!" + name).c_str(), &status))
+            throw error(status);
+        if (compression != FitsCompression::None &&
+                fits_set_compression_type(file, CompressionType(compression), &status))
+            throw error(status);
+    }
+
+    ~ExtensionFile()
+    {
+        int status = 0;
+        fits_close_file(file, &status);
+        if (status)
+            std::cout << "Error closing " << name << ": code " << status << std::endl;
+    }
+
+    void Write(uint16_t const* pixels) override
+    {
+        int status = 0;
+        long axes[] = { width, height };
+        if (fits_create_img(file, USHORT_IMG, 2, axes, &status))
+            throw error(status);
+        long firstpix[] = { 1, 1 };
+        if (fits_write_pix(file, TUSHORT, firstpix, (long)width * height,
+                    const_cast<uint16_t*>(pixels), &status))
+            throw error(status);
+        count++;
+    }
+};
+
+// Raw SER video: a 178 byte header and then little-endian frames back to back,
+// written through a large stdio buffer so the disk sees long sequential writes.
+class SerFile : public BurstFile
+{
+    static const size_t headerSize = 178;
+    static const size_t frameCountOffset = 38;
+
+    FILE* file;
+    std::vector<char> buffer;
+
+    static void Put32(char* dest, int32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            dest[i] = (char)((uint32_t)value >> (8 * i));
+    }
+
+    static void Put64(char* dest, int64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+            dest[i] = (char)((uint64_t)value >> (8 * i));
+    }
+
+    public:
+    SerFile(std::string name, int width, int height)
+        : BurstFile(name, width, height), buffer(8 << 20)
+    {
+        file = fopen(name.c_str(), "wb");
+        if (!file)
+            throw std::runtime_error("Could not create " + name);
+        setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+
+        // Dates are in 100 ns ticks since year 1.
+        int64_t ticks = 621355968000000000LL + (int64_t)time(nullptr) * 10000000LL;
+        char header[headerSize] = {};
+        memcpy(header, "LUCAM-RECORDER", 14);
+        Put32(header + 14, 0); // LuID
+        Put32(header + 18, 0); // ColorID: mono
+        Put32(header + 22, 1); // little-endian pixels
+        Put32(header + 26, width);
+        Put32(header + 30, height);
+        Put32(header + 34, 16);
+        Put32(header + frameCountOffset, 0);
+        memcpy(header + 42 + 40, "Lumenera", 8);
+        Put64(header + 162, ticks);
+        Put64(header + 170, ticks);
+        if (fwrite(header, 1, headerSize, file) != headerSize)
+            throw std::runtime_error("Could not write " + name);
+    }
+
+    ~SerFile()
+    {
+        char frames[4];
+        Put32(frames, (int32_t)count);
+        if (fseek(file, frameCountOffset, SEEK_SET) != 0 || fwrite(frames, 1, 4, file) != 4)
+            std::cout << "Error finishing " << name << std::endl;
+        if (fclose(file) != 0)
+            std::cout << "Error closing " << name << std::endl;
+    }
+
+    void Write(uint16_t const* pixels) override
+    {
+        size_t size = (size_t)width * height;
+        if (fwrite(pixels, sizeof(uint16_t), size, file) != size)
+            throw std::runtime_error("Could not write " + name);
+        count++;
+    }
+};
+
+FitsWriter::FitsWriter(size_t maxDepth, Policy policy, Format format,
+        FitsCompression compression, int numThreads)
+    : policy(policy), format(format), compression(compression),
+    queue(std::max(maxDepth, (size_t)1)),
+    depth(0), dropped(0), written(0), lastLatency(0), averageLatency(0)
+{
+    if (compression != FitsCompression::None &&
+            format != Format::Files && format != Format::Extensions)
+        throw std::runtime_error("Compression needs one file or one extension per frame");
+    if (format != Format::Files)
+        numThreads = 1;
+    if (numThreads > 1 && compression != FitsCompression::None && !fits_is_reentrant())
+    {
+        std::cout << "cfitsio is not thread safe, compressing on one thread" << std::endl;
+        numThreads = 1;
+    }
+    for (int i = 0; i < std::max(numThreads, 1); i++)
+        threads.emplace_back([this]() { Run(); });
+}
+
+FitsWriter::~FitsWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    notEmpty.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+    EndBurst();
+}
+
+bool FitsWriter::Enqueue(FrameRef frame, int remaining)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto burstId = nextBurst;
+    if (remaining == 0)
+        nextBurst++;
+    if (depth == queue.size())
+    {
+        if (policy == Policy::Drop)
+        {
+            // The burst still has to be closed once the queue drains.
+            if (remaining == 0)
+            {
+                endRequested = true;
+                notEmpty.notify_one();
+            }
+            dropped++;
+            return false;
+        }
+        notFull.wait(lock, [this]() { return depth < queue.size(); });
+    }
+    auto& entry = queue[(head + depth) % queue.size()];
+    entry.frame = std::move(frame);
+    entry.remaining = remaining;
+    entry.burstId = burstId;
+    depth++;
+    notEmpty.notify_one();
+    return true;
+}
+
+void FitsWriter::Run()
+{
+    while (true)
+    {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this]() { return depth > 0 || closing || endRequested; });
+            if (depth == 0)
+            {
+                if (closing)
+                    return;
+                // only a burst that has seen its last frame, even if that
+                // was dropped; frames of a newer one may still be coming
+                endRequested = false;
+                bool ended = openBurst < nextBurst;
+                lock.unlock();
+                if (ended)
+                    EndBurst();
+                continue;
+            }
+            entry = std::move(queue[head]);
+            head = (head + 1) % queue.size();
+            depth--;
+        }
+        notFull.notify_one();
+
+        auto start = std::chrono::steady_clock::now();
+        auto sequence = entry.frame->sequence;
+        try
+        {
+            StageTimer timer(Timing::Stage::Write, sequence);
+            Write(entry);
+            written++;
+        }
+        catch (std::exception const& ex)
+        {
+            std::cout << "Exception while saving!" << std::endl;
+            std::cout << ex.what() << std::endl;
+            burst.reset();
+        }
+        entry.frame.reset();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        lastLatency = elapsed.count();
+        averageLatency = averageLatency == 0 ? elapsed.count() : averageLatency * 0.9 + elapsed.count() * 0.1;
+    }
+}
+
+void FitsWriter::Write(Entry const& entry)
+{
+    auto& frame = *entry.frame;
+    if (format == Format::Files)
+    {
+        if (compression == FitsCompression::None)
+            WriteFits(frame.data(), (long)frame.size(), frame.width);
+        else
+        {
+            auto name = UniqueName("image", ".fits.fz");
+            WriteFitsCompressed(name, frame.data(), frame.width, frame.height, compression);
+            std::cout << "Saved " << name << std::endl;
+        }
+        return;
+    }
+    if (burst && (entry.burstId != openBurst || !burst->Fits(frame)))
+        EndBurst();
+    if (!burst)
+    {
+        openBurst = entry.burstId;
+        if (format == Format::Cube)
+            burst.reset(new CubeFile(UniqueName("burst", ".fits"), frame.width, frame.height,
+                        entry.remaining + 1));
+        else if (format == Format::Extensions)
+            burst.reset(new ExtensionFile(UniqueName("burst", compression == FitsCompression::None ?
+                            ".fits" : ".fits.fz"), frame.width, frame.height, compression));
+        else
+            burst.reset(new SerFile(UniqueName("burst", ".ser"), frame.width, frame.height));
+    }
+    burst->Write(frame.data());
+    if (entry.remaining == 0)
+        EndBurst();
+}
+
+void FitsWriter::EndBurst()
+{
+    if (!burst)
+        return;
+    auto name = burst->Name();
+    auto count = burst->Count();
+    burst.reset();
+    std::cout << "Saved " << count << " frames to " << name << std::endl;
+}
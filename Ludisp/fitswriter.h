@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framering.h"
+
+std::runtime_error error(int status);
+
+// Lossless tile compression for saved frames.
+enum class FitsCompression
+{
+    None,
+    Rice,
+    Hcompress
+};
+
+void WriteFits(std::string filename, uint16_t const* pixels, long size, int width);
+void WriteFits(uint16_t const* pixels, long size, int width);
+void WriteFitsCompressed(std::string filename, uint16_t const* pixels, int width, int height,
+        FitsCompression compression);
+// planes > 1 writes a cube of that many width x height planes, such as R, G
+// and B.
+void WriteFitsFloat(std::string filename, float const* pixels, int width, int height, int planes = 1);
+std::vector<float> ReadFitsFloat(std::string filename, int& width, int& height);
+
+class BurstFile;
+
+// Drains saved frames to disk on its own thread so that cfitsio and the disk
+// never stall the capture loop. The queue holds at most maxDepth frames; when
+// it is full Enqueue either waits for room or discards the frame.
+//
+// Frames are either written one file each, or a whole burst goes into a
+// single file that stays open until the burst ends: a NAXIS3 cube, one image
+// extension per frame, or a raw SER stream. One file per frame can use
+// several threads, so compressing doesn't limit the frame rate; bursts are
+// written in order by a single thread.
+class FitsWriter
+{
+    public:
+    enum class Policy
+    {
+        Block,
+        Drop
+    };
+
+    enum class Format
+    {
+        Files,
+        Cube,
+        Extensions,
+        Ser
+    };
+
+    FitsWriter(size_t maxDepth, Policy policy, Format format,
+            FitsCompression compression, int numThreads);
+    ~FitsWriter();
+
+    // remaining is the number of frames still to come in this burst; the
+    // burst file is sized from it and closed after the frame with zero.
+    // Returns false if the frame was dropped.
+    bool Enqueue(FrameRef frame, int remaining);
+
+    size_t Depth() const { return depth; }
+    size_t MaxDepth() const { return queue.size(); }
+    Policy GetPolicy() const { return policy; }
+    Format GetFormat() const { return format; }
+    FitsCompression GetCompression() const { return compression; }
+    size_t Threads() const { return threads.size(); }
+    unsigned long Dropped() const { return dropped; }
+    unsigned long Written() const { return written; }
+    // Milliseconds spent writing the most recent frame, and a smoothed value.
+    double LastLatency() const { return lastLatency; }
+    double AverageLatency() const { return averageLatency; }
+
+    private:
+    struct Entry
+    {
+        FrameRef frame;
+        int remaining = 0;
+        // which burst the frame belongs to, counted by Enqueue
+        unsigned long burstId = 0;
+    };
+
+    void Run();
+    void Write(Entry const& entry);
+    void EndBurst();
+
+    Policy policy;
+    Format format;
+    FitsCompression compression;
+    std::vector<Entry> queue;
+    std::unique_ptr<BurstFile> burst;
+    unsigned long openBurst = 0;
+    // Bumped by every last frame of a burst, kept or dropped, so a burst
+    // whose end was dropped still closes before the next one starts.
+    unsigned long nextBurst = 0;
+    bool endRequested = false;
+    size_t head = 0;
+    std::atomic<size_t> depth;
+    std::atomic<unsigned long> dropped;
+    std::atomic<unsigned long> written;
+    std::atomic<double> lastLatency;
+    std::atomic<double> averageLatency;
+    bool closing = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::vector<std::thread> threads;
+};
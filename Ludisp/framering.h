@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// One preallocated image slot. The capture thread fills it, everybody else
+// only reads it while holding a FrameRef.
+struct Frame
+{
+    std::vector<uint16_t> pixels;
+    int width = 0;
+    int height = 0;
+    unsigned long sequence = 0;
+    // Timing::Now() when readout finished and when it was queued for display
+    int64_t captured = 0;
+    int64_t queued = 0;
+    // lucky imaging score, set while selection is on
+    double sharpness = 0;
+    std::atomic<int> refs;
+
+    Frame() : refs(0) {}
+    Frame(Frame const&) = delete;
+    Frame& operator=(Frame const&) = delete;
+
+    uint16_t* data() { return pixels.data(); }
+    uint16_t const* data() const { return pixels.data(); }
+    size_t size() const { return (size_t)width * height; }
+};
+
+// Columns [x0, x1) of rows [y0, y1) of a frame.
+struct Region
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// Reference-counted handle to a pooled Frame. When the last handle goes
+// away the slot becomes free for the capture thread to reuse.
+class FrameRef
+{
+    Frame* frame;
+
+    void Release()
+    {
+        if (frame)
+            frame->refs.fetch_sub(1, std::memory_order_release);
+        frame = nullptr;
+    }
+
+    public:
+    FrameRef() : frame(nullptr) {}
+    explicit FrameRef(Frame* adopt) : frame(adopt) {}
+    FrameRef(FrameRef const& other) : frame(other.frame)
+    {
+        if (frame)
+            frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    FrameRef(FrameRef&& other) : frame(other.frame)
+    {
+        other.frame = nullptr;
+    }
+    FrameRef& operator=(FrameRef other)
+    {
+        std::swap(frame, other.frame);
+        return *this;
+    }
+    ~FrameRef()
+    {
+        Release();
+    }
+
+    void reset() { Release(); }
+    Frame* get() const { return frame; }
+    Frame* operator->() const { return frame; }
+    Frame& operator*() const { return *frame; }
+    explicit operator bool() const { return frame != nullptr; }
+};
+
+// Fixed set of frame slots, all allocated up front so that the capture loop
+// never allocates. Only the capture thread may call Acquire.
+class FramePool
+{
+    std::vector<Frame> frames;
+    size_t next = 0;
+
+    public:
+    FramePool(size_t count, size_t capacity) : frames(count)
+    {
+        for (auto& frame : frames)
+            frame.pixels.resize(capacity);
+    }
+
+    size_t Count() const { return frames.size(); }
+    size_t Capacity() const { return frames.empty() ? 0 : frames[0].pixels.size(); }
+
+    // True once no slot is referenced any more, so the pool can go.
+    bool Idle() const
+    {
+        for (auto const& frame : frames)
+            if (frame.refs.load(std::memory_order_acquire) != 0)
+                return false;
+        return true;
+    }
+
+    // Returns an empty handle if every slot is still referenced.
+    FrameRef Acquire(int width, int height)
+    {
+        if ((size_t)width * height > Capacity())
+            throw std::runtime_error("Frame does not fit in pool slot");
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            auto& frame = frames[(next + i) % frames.size()];
+            if (frame.refs.load(std::memory_order_acquire) == 0)
+            {
+                next = (next + i + 1) % frames.size();
+                frame.refs.store(1, std::memory_order_relaxed);
+                // nothing from the slot's last frame may leak into this one
+                frame.width = width;
+                frame.height = height;
+                frame.sequence = 0;
+                frame.captured = 0;
+                frame.queued = 0;
+                frame.sharpness = 0;
+                return FrameRef(&frame);
+            }
+        }
+        return FrameRef();
+    }
+};
+
+// Lock-free single-producer/single-consumer queue. Capacity must be a power
+// of two.
+template<typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    T items[Capacity];
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+
+    public:
+    SpscQueue() : head(0), tail(0) {}
+
+    bool Push(T&& item)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity)
+            return false;
+        items[t % Capacity] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& item)
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = std::move(items[h % Capacity]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
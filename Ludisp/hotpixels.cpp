@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "hotpixels.h"
+
+// Enough samples of the dark for its median and MAD.
+static const size_t maxSamples = 1 << 20;
+
+// Comparators of an 8-input sorting network; after them the 4th and 5th
+// values are the two middle ones.
+static const int network[19][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },
+    { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+    { 1, 2 }, { 5, 6 }, { 0, 4 }, { 3, 7 },
+    { 1, 5 }, { 2, 6 }, { 1, 4 }, { 3, 6 },
+    { 2, 4 }, { 3, 5 }, { 3, 4 }
+};
+
+template<typename T>
+static double Median(std::vector<T>& values)
+{
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+// The median of count values, rounding the mean of the middle two up like
+// _mm_avg_epu16.
+static uint16_t MedianOf(uint16_t* values, int count)
+{
+    std::sort(values, values + count);
+    if (count % 2)
+        return values[count / 2];
+    return (uint16_t)((values[count / 2 - 1] + values[count / 2] + 1) >> 1);
+}
+
+HotPixelMap::HotPixelMap(double thresholdSigma)
+    : thresholdSigma(std::max(thresholdSigma, 0.0)), count(0)
+{
+}
+
+void HotPixelMap::Clear()
+{
+    width = 0;
+    height = 0;
+    indices.clear();
+    full.clear();
+    fullNeighbours.clear();
+    partial.clear();
+    partialStart.clear();
+    partialNeighbours.clear();
+    count = 0;
+}
+
+void HotPixelMap::Swap(HotPixelMap& other)
+{
+    std::swap(thresholdSigma, other.thresholdSigma);
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    indices.swap(other.indices);
+    full.swap(other.full);
+    fullNeighbours.swap(other.fullNeighbours);
+    partial.swap(other.partial);
+    partialStart.swap(other.partialStart);
+    partialNeighbours.swap(other.partialNeighbours);
+    size_t otherCount = other.count;
+    other.count = count.load();
+    count = otherCount;
+}
+
+void HotPixelMap::Build(std::vector<float> const& dark, int darkWidth, int darkHeight)
+{
+    Clear();
+    size_t size = (size_t)darkWidth * darkHeight;
+    if (thresholdSigma <= 0 || size == 0 || dark.size() < size)
+        return;
+
+    size_t step = std::max(size / maxSamples, (size_t)1);
+    std::vector<float> samples;
+    samples.reserve(size / step + 1);
+    for (size_t i = 0; i < size; i += step)
+        samples.push_back(dark[i]);
+    double median = Median(samples);
+    for (auto& value : samples)
+        value = std::fabs(value - (float)median);
+    // a noiseless dark would otherwise make every warm pixel hot
+    double sigma = std::max(1.4826 * Median(samples), 1.0);
+    float excess = (float)(thresholdSigma * sigma);
+    float level = (float)median + excess;
+
+    // rows in order, so the list comes out sorted
+    std::vector<float> around;
+    around.reserve(8);
+    for (int y = 0; y < darkHeight; y++)
+    {
+        auto row = dark.data() + (size_t)y * darkWidth;
+        for (int x = 0; x < darkWidth; x++)
+        {
+            if (row[x] <= level)
+                continue;
+            around.clear();
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                    if ((dx || dy) && x + dx >= 0 && x + dx < darkWidth && y + dy >= 0 && y + dy < darkHeight)
+                        around.push_back(row[(ptrdiff_t)dy * darkWidth + x + dx]);
+            if (row[x] - Median(around) > excess)
+                indices.push_back((uint32_t)((size_t)y * darkWidth + x));
+        }
+    }
+
+    auto isHot = [&](uint32_t index)
+    {
+        return std::binary_search(indices.begin(), indices.end(), index);
+    };
+    std::vector<uint32_t> neighbours;
+    for (auto index : indices)
+    {
+        int x = (int)(index % darkWidth);
+        int y = (int)(index / darkWidth);
+        // a cluster of hot pixels reaches out to the next ring
+        for (int radius = 1; radius <= 2 && neighbours.empty(); radius++)
+        {
+            for (int dy = -radius; dy <= radius; dy++)
+            {
+                for (int dx = -radius; dx <= radius; dx++)
+                {
+                    if (std::max(std::abs(dx), std::abs(dy)) != radius ||
+                            x + dx < 0 || x + dx >= darkWidth || y + dy < 0 || y + dy >= darkHeight)
+                        continue;
+                    auto neighbour = (uint32_t)((size_t)(y + dy) * darkWidth + x + dx);
+                    if (!isHot(neighbour))
+                        neighbours.push_back(neighbour);
+                }
+            }
+        }
+        if (neighbours.size() == 8)
+        {
+            full.push_back(index);
+            fullNeighbours.insert(fullNeighbours.end(), neighbours.begin(), neighbours.end());
+        }
+        else if (!neighbours.empty())
+        {
+            partial.push_back(index);
+            partialStart.push_back((uint32_t)partialNeighbours.size());
+            partialNeighbours.insert(partialNeighbours.end(), neighbours.begin(), neighbours.end());
+        }
+        neighbours.clear();
+    }
+    partialStart.push_back((uint32_t)partialNeighbours.size());
+    width = darkWidth;
+    height = darkHeight;
+    count = indices.size();
+    std::cout << "Hot pixel map: " << indices.size() << " pixels above " << thresholdSigma
+        << " sigma (" << sigma << " ADU)" << std::endl;
+}
+
+static void CorrectFullScalar(uint16_t* pixels, uint32_t const* targets,
+        uint32_t const* neighbours, size_t count)
+{
+    for (size_t i = 0; i < count; i++, neighbours += 8)
+    {
+        uint16_t values[8];
+        for (int k = 0; k < 8; k++)
+            values[k] = pixels[neighbours[k]];
+        for (auto const& pair : network)
+        {
+            uint16_t low = std::min(values[pair[0]], values[pair[1]]);
+            values[pair[1]] = std::max(values[pair[0]], values[pair[1]]);
+            values[pair[0]] = low;
+        }
+        pixels[targets[i]] = (uint16_t)((values[3] + values[4] + 1) >> 1);
+    }
+}
+
+#if LUDISP_X86
+// Sorts eight hot pixels' neighbourhoods at once, one per lane. The loads
+// and stores are scattered either way; the network is what vectorizes.
+TARGET_SSE2 static void CorrectFullSse2(uint16_t* pixels, uint32_t const* targets,
+        uint32_t const* neighbours, size_t count)
+{
+    // SSE2 only compares signed words, so the values are biased first
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        alignas(16) uint16_t lanes[8][8];
+        for (int j = 0; j < 8; j++)
+            for (int k = 0; k < 8; k++)
+                lanes[k][j] = pixels[neighbours[(i + j) * 8 + k]];
+        __m128i values[8];
+        for (int k = 0; k < 8; k++)
+            values[k] = _mm_xor_si128(_mm_load_si128(reinterpret_cast<__m128i const*>(lanes[k])), flip);
+        for (auto const& pair : network)
+        {
+            __m128i low = _mm_min_epi16(values[pair[0]], values[pair[1]]);
+            values[pair[1]] = _mm_max_epi16(values[pair[0]], values[pair[1]]);
+            values[pair[0]] = low;
+        }
+        __m128i median = _mm_avg_epu16(_mm_xor_si128(values[3], flip), _mm_xor_si128(values[4], flip));
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes[0]), median);
+        for (int j = 0; j < 8; j++)
+            pixels[targets[i + j]] = lanes[0][j];
+    }
+    CorrectFullScalar(pixels, targets + i, neighbours + i * 8, count - i);
+}
+
+TARGET_AVX2 static void CorrectFullAvx2(uint16_t* pixels, uint32_t const* targets,
+        uint32_t const* neighbours, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        alignas(32) uint16_t lanes[8][16];
+        for (int j = 0; j < 16; j++)
+            for (int k = 0; k < 8; k++)
+                lanes[k][j] = pixels[neighbours[(i + j) * 8 + k]];
+        __m256i values[8];
+        for (int k = 0; k < 8; k++)
+            values[k] = _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[k]));
+        for (auto const& pair : network)
+        {
+            __m256i low = _mm256_min_epu16(values[pair[0]], values[pair[1]]);
+            values[pair[1]] = _mm256_max_epu16(values[pair[0]], values[pair[1]]);
+            values[pair[0]] = low;
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[0]), _mm256_avg_epu16(values[3], values[4]));
+        for (int j = 0; j < 16; j++)
+            pixels[targets[i + j]] = lanes[0][j];
+    }
+    CorrectFullScalar(pixels, targets + i, neighbours + i * 8, count - i);
+}
+#endif
+
+void HotPixelMap::Correct(uint16_t* pixels, int frameWidth, int frameHeight, SimdLevel level) const
+{
+    if (indices.empty() || frameWidth != width || frameHeight != height)
+        return;
+    // no hot pixel is anyone's neighbour, so the order doesn't matter
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            CorrectFullAvx2(pixels, full.data(), fullNeighbours.data(), full.size());
+            break;
+        case SimdLevel::Sse2:
+            CorrectFullSse2(pixels, full.data(), fullNeighbours.data(), full.size());
+            break;
+#endif
+        default:
+            CorrectFullScalar(pixels, full.data(), fullNeighbours.data(), full.size());
+            break;
+    }
+    uint16_t values[24];
+    for (size_t i = 0; i < partial.size(); i++)
+    {
+        int n = 0;
+        for (auto k = partialStart[i]; k < partialStart[i + 1]; k++)
+            values[n++] = pixels[partialNeighbours[k]];
+        pixels[partial[i]] = MedianOf(values, n);
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "simd.h"
+
+// Hot pixels found in a master dark, kept as a sorted list of pixel indices.
+// Correcting a frame replaces each of them with the median of its
+// neighbours that aren't hot themselves, so the cost per frame depends on
+// the number of hot pixels and not on the frame size. The neighbour indices
+// are worked out once when the map is built.
+class HotPixelMap
+{
+    public:
+    // thresholdSigma 0 never finds any.
+    explicit HotPixelMap(double thresholdSigma = 8);
+
+    // A pixel is hot if it is thresholdSigma robust sigmas above both the
+    // median of the dark and the median of its own neighbours, so bright
+    // corners from amp glow don't count.
+    void Build(std::vector<float> const& dark, int width, int height);
+    void Clear();
+    // Exchanges maps, so one built on another thread can be put in place
+    // without copying.
+    void Swap(HotPixelMap& other);
+
+    // Does nothing if the frame doesn't match the dark the map was built from.
+    void Correct(uint16_t* pixels, int width, int height, SimdLevel level) const;
+    void Correct(uint16_t* pixels, int width, int height) const
+    {
+        Correct(pixels, width, height, DetectSimd());
+    }
+
+    std::vector<uint32_t> const& Indices() const { return indices; }
+    // Any thread.
+    size_t Count() const { return count; }
+    double ThresholdSigma() const { return thresholdSigma; }
+
+    private:
+    double thresholdSigma;
+    int width = 0;
+    int height = 0;
+    std::vector<uint32_t> indices;
+    std::atomic<size_t> count;
+
+    // Hot pixels with all 8 neighbours usable, grouped so the vector
+    // kernels can take one from each group per lane.
+    std::vector<uint32_t> full;
+    std::vector<uint32_t> fullNeighbours;
+    // The rest, at edges or next to other hot pixels, with however many
+    // neighbours they have; partialStart has one more entry than partial.
+    std::vector<uint32_t> partial;
+    std::vector<uint32_t> partialStart;
+    std::vector<uint32_t> partialNeighbours;
+};
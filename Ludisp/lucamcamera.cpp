@@ -0,0 +1,193 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include "lucamcamera.h"
+
+LucamCamera::LucamCamera(int queueDepth) : queueDepth(queueDepth)
+{
+    _lucam_version_info versionInfo;
+    int versionsCount = 1;
+    if (lucam_enum_cameras(&versionInfo, &versionsCount))
+        throw std::runtime_error("Lucam error on lucam_enum_cameras");
+    if (versionsCount == 0)
+        throw std::runtime_error("No Lumenera cameras found");
+    camera = lucam_camera_open(versionInfo.minor);
+    if (camera == nullptr)
+        throw std::runtime_error("Lucam error on lucam_camera_open");
+    if (lucam_camera_reset(camera))
+        throw std::runtime_error("Lucam error on lucam_camera_reset");
+    if (lucam_set_mode(camera, LUCAM_MODE_STILL_SW_TRIGGER))
+        throw std::runtime_error("Lucam error on lucam_set_mode");
+    _lucam_frame_format format;
+    if (lucam_get_still_format(camera, &format))
+        throw std::runtime_error("Lucam error on lucam_get_still_format");
+    format.binningX = 1;
+    format.binningY = 1;
+    format.pixelformat = LUCAM_PIXEL_FORMAT_16BITS;
+    width = sensorWidth = format.width;
+    height = sensorHeight = format.height;
+    if (lucam_set_still_format(camera, &format))
+        throw std::runtime_error("Lucam error on lucam_set_still_format");
+
+    SetProperty(LUCAM_PROP_TIMEOUT, -1);
+    //SetProperty(LUCAM_PROP_GAMMA, 100);
+    //SetProperty(LUCAM_PROP_CONTRAST, 100);
+    //SetProperty(LUCAM_PROP_BRIGHTNESS, 100);
+    SetProperty(LUCAM_PROP_STILL_GAIN, GAIN_MULT_FACTOR);
+    SetProperty(LUCAM_PROP_STILL_EXPOSURE, 1000000);
+}
+
+LucamCamera::~LucamCamera()
+{
+    lucam_camera_close(camera);
+}
+
+bool LucamCamera::SetReadout(Readout const& readout)
+{
+    int roiWidth = readout.width > 0 ? readout.width : sensorWidth;
+    int roiHeight = readout.height > 0 ? readout.height : sensorHeight;
+    if (readout.x < 0 || readout.y < 0 || readout.binning < 1 ||
+            readout.x + roiWidth > sensorWidth || readout.y + roiHeight > sensorHeight)
+        throw std::runtime_error("Readout region does not fit the " + std::to_string(sensorWidth) +
+                "x" + std::to_string(sensorHeight) + " sensor");
+    _lucam_frame_format format;
+    if (lucam_get_still_format(camera, &format))
+        throw std::runtime_error("Lucam error on lucam_get_still_format");
+    // the format is in unbinned pixels; the frames come out binned
+    format.xOffset = readout.x;
+    format.yOffset = readout.y;
+    format.width = roiWidth / readout.binning * readout.binning;
+    format.height = roiHeight / readout.binning * readout.binning;
+    format.binningX = readout.binning;
+    format.binningY = readout.binning;
+    format.flagsX = readout.binning > 1 ? LUCAM_FRAME_FORMAT_FLAGS_BINNING : 0;
+    format.flagsY = format.flagsX;
+    format.pixelformat = LUCAM_PIXEL_FORMAT_16BITS;
+    bool binned = true;
+    if (lucam_set_still_format(camera, &format))
+    {
+        if (readout.binning == 1)
+            throw std::runtime_error("Lucam error on lucam_set_still_format");
+        // not every model bins by every factor; read the region unbinned
+        binned = false;
+        format.width = roiWidth;
+        format.height = roiHeight;
+        format.binningX = 1;
+        format.binningY = 1;
+        format.flagsX = 0;
+        format.flagsY = 0;
+        if (lucam_set_still_format(camera, &format))
+            throw std::runtime_error("Lucam error on lucam_set_still_format");
+    }
+    width = format.width / format.binningX;
+    height = format.height / format.binningY;
+    return binned;
+}
+
+void LucamCamera::StartStreaming()
+{
+    buffercount = lucam_get_buffer_count(camera);
+    buffer = 0;
+    // the buffer being read can't also be exposed into
+    depth = std::max(std::min(queueDepth, buffercount - 1), 0);
+    inFlight = 0;
+    stale = 0;
+    if (lucam_enable_streaming(camera))
+        throw std::runtime_error("Lucam error on lucam_enable_streaming");
+    for (int i = 0; i < (depth > 0 ? buffercount : 1); i++)
+        if (lucam_start_capture_to_buffer(camera, i, LUCAM_PIXEL_FORMAT_16BITS))
+            throw std::runtime_error("Lucam error on lucam_start_capture_to_buffer");
+    if (lucam_start_streaming(camera))
+        throw std::runtime_error("Lucam error on lucam_start_streaming");
+    for (int i = 0; i < depth; i++)
+        Trigger();
+    std::cout << "Camera thread running with " << buffercount << " buffers, " <<
+        depth << " queued" << std::endl;
+}
+
+void LucamCamera::Trigger()
+{
+    if (lucam_software_trigger(camera) < 0)
+        throw std::runtime_error("Lucam error on lucam_software_trigger");
+    inFlight++;
+}
+
+void LucamCamera::StopStreaming()
+{
+    if (lucam_stop_streaming(camera))
+        throw std::runtime_error("Lucam error on lucam_stop_streaming");
+    if (lucam_disable_streaming(camera))
+        throw std::runtime_error("Lucam error on lucam_disable_streaming");
+}
+
+void LucamCamera::Capture(uint16_t* dest)
+{
+    if (depth > 0)
+    {
+        CaptureQueued(dest);
+        return;
+    }
+    if (lucam_start_capture_to_buffer(camera,
+                (buffer + 1) % buffercount,
+                LUCAM_PIXEL_FORMAT_16BITS))
+        throw std::runtime_error("Lucam error on lucam_start_capture_to_buffer");
+    if (lucam_software_trigger(camera) < 0)
+        throw std::runtime_error("Lucam error on lucam_software_trigger");
+    if (lucam_wait_for_capture_to_buffer(camera, buffer))
+        throw std::runtime_error("Lucam error on lucam_wait_for_capture_to_buffer");
+    auto address = reinterpret_cast<uint16_t*>(lucam_get_buffer_address(camera, buffer));
+    auto size = std::min(lucam_get_still_frame_size(camera) / sizeof(uint16_t), (size_t)width * height);
+    std::copy(address, address + size, dest);
+    buffer = (buffer + 1) % buffercount;
+}
+
+void LucamCamera::CaptureQueued(uint16_t* dest)
+{
+    while (true)
+    {
+        if (lucam_wait_for_capture_to_buffer(camera, buffer))
+            throw std::runtime_error("Lucam error on lucam_wait_for_capture_to_buffer");
+        inFlight--;
+        // refill the queue first, so the sensor is exposing while this
+        // frame is copied out and processed
+        Trigger();
+        bool keep = stale == 0;
+        if (keep)
+        {
+            auto address = reinterpret_cast<uint16_t*>(lucam_get_buffer_address(camera, buffer));
+            auto size = std::min(lucam_get_still_frame_size(camera) / sizeof(uint16_t), (size_t)width * height);
+            std::copy(address, address + size, dest);
+        }
+        else
+            stale--;
+        if (lucam_start_capture_to_buffer(camera, buffer, LUCAM_PIXEL_FORMAT_16BITS))
+            throw std::runtime_error("Lucam error on lucam_start_capture_to_buffer");
+        buffer = (buffer + 1) % buffercount;
+        if (keep)
+            return;
+    }
+}
+
+void LucamCamera::SetExposure(double seconds)
+{
+    SetProperty(LUCAM_PROP_STILL_EXPOSURE, (LONG)(1000000 * seconds));
+    // frames already triggered were exposed with the old value
+    stale = inFlight;
+}
+
+void LucamCamera::SetProperty(int property, LONG value)
+{
+    LONG oldValue = 0;
+    ULONG oldFlags = 0;
+    if (lucam_property_get(camera, property, &oldValue, &oldFlags))
+        throw std::runtime_error("Failed to get property " + std::to_string(property));
+    LONG min, max, rvalue;
+    ULONG caps;
+    if (lucam_property_get_range(camera, property, &min, &max, &rvalue, &caps))
+        throw std::runtime_error("Lucam error in lucam_property_get_range");
+    std::cout << min << " < " << value << " < " << max << std::endl;
+    // not sure why it's <0
+    if (lucam_property_set(camera, property, value, oldFlags) < 0)
+        throw std::runtime_error("Failed to set property " + std::to_string(property));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <lucamapi.h>
+#include "camera.h"
+
+// Lumenera camera driven in software-triggered still mode.
+//
+// With a queue depth of zero each frame is triggered when Capture asks for
+// it. Otherwise every driver buffer is armed up front and queueDepth frames
+// stay triggered ahead of the one being read, so the next exposure runs
+// while this frame is copied and processed.
+class LucamCamera : public Camera
+{
+    _lucam* camera;
+    int width;
+    int height;
+    int sensorWidth;
+    int sensorHeight;
+    int buffercount = 0;
+    int buffer = 0;
+    int queueDepth;
+    int depth = 0;
+    int inFlight = 0;
+    // triggered before the last exposure change, to be thrown away
+    int stale = 0;
+
+    void Trigger();
+    void CaptureQueued(uint16_t* dest);
+
+    public:
+    explicit LucamCamera(int queueDepth = 0);
+    ~LucamCamera();
+
+    std::string Name() const override { return "Lucam"; }
+    int Width() const override { return width; }
+    int Height() const override { return height; }
+    bool SetReadout(Readout const& readout) override;
+
+    void StartStreaming() override;
+    void StopStreaming() override;
+    void Capture(uint16_t* dest) override;
+    void SetExposure(double seconds) override;
+
+    void SetProperty(int property, LONG value);
+};
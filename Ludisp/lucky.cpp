@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include "lucky.h"
+
+// Grid step for finding the centroid; the planet spans many steps.
+static const int centroidStep = 4;
+
+Sharpness::Sharpness(int roiSize) : roiSize(std::max(roiSize, 0)), enabled(false), lastScore(0)
+{
+}
+
+double Sharpness::Score(Frame const& frame, ThreadPool& pool)
+{
+    int width = frame.width;
+    int height = frame.height;
+    auto pixels = frame.data();
+
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = width;
+    int y1 = height;
+    if (roiSize > 0 && (roiSize < width || roiSize < height))
+    {
+        // centroid of whatever is brighter than the mean, on a coarse grid
+        double mean = 0;
+        long count = 0;
+        for (int y = 0; y < height; y += centroidStep)
+            for (int x = 0; x < width; x += centroidStep, count++)
+                mean += pixels[(size_t)y * width + x];
+        mean /= std::max(count, 1L);
+        double sum = 0;
+        double sumX = 0;
+        double sumY = 0;
+        for (int y = 0; y < height; y += centroidStep)
+        {
+            for (int x = 0; x < width; x += centroidStep)
+            {
+                double value = pixels[(size_t)y * width + x] - mean;
+                if (value <= 0)
+                    continue;
+                sum += value;
+                sumX += value * x;
+                sumY += value * y;
+            }
+        }
+        int cx = sum > 0 ? (int)(sumX / sum) : width / 2;
+        int cy = sum > 0 ? (int)(sumY / sum) : height / 2;
+        int roiWidth = std::min(roiSize, width);
+        int roiHeight = std::min(roiSize, height);
+        x0 = std::min(std::max(cx - roiWidth / 2, 0), width - roiWidth);
+        y0 = std::min(std::max(cy - roiHeight / 2, 0), height - roiHeight);
+        x1 = x0 + roiWidth;
+        y1 = y0 + roiHeight;
+    }
+    if (x1 - x0 < 3 || y1 - y0 < 3)
+        return 0;
+
+    // 4-neighbour Laplacian of the interior, summed per band
+    std::mutex mutex;
+    double sumPixel = 0;
+    double sumLaplacian = 0;
+    double sumSquares = 0;
+    pool.ParallelRows(y1 - y0 - 2, 8, [&](int begin, int end)
+            {
+            int64_t pixel = 0;
+            int64_t laplacian = 0;
+            double squares = 0;
+            for (int y = y0 + 1 + begin; y < y0 + 1 + end; y++)
+            {
+                auto row = pixels + (size_t)y * width;
+                auto up = row - width;
+                auto down = row + width;
+                int64_t rowSquares = 0;
+                for (int x = x0 + 1; x < x1 - 1; x++)
+                {
+                    int value = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+                    pixel += row[x];
+                    laplacian += value;
+                    rowSquares += (int64_t)value * value;
+                }
+                squares += (double)rowSquares;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            sumPixel += (double)pixel;
+            sumLaplacian += (double)laplacian;
+            sumSquares += squares;
+            });
+    double count = (double)(x1 - x0 - 2) * (y1 - y0 - 2);
+    double mean = sumPixel / count;
+    double meanLaplacian = sumLaplacian / count;
+    double variance = sumSquares / count - meanLaplacian * meanLaplacian;
+    double score = mean > 0 ? variance / (mean * mean) : 0;
+    lastScore = score;
+    return score;
+}
+
+LuckySelector::LuckySelector(int window, double keepFraction)
+    : window(std::max(window, 1)), keepFraction(std::min(std::max(keepFraction, 0.0), 1.0)),
+    enabled(false), totalSeen(0), totalKept(0)
+{
+    if (this->keepFraction <= 0)
+        throw std::runtime_error("Lucky imaging has to keep some frames");
+    capacity = std::max(Expected(this->window), 1);
+    heap.reserve(capacity);
+}
+
+void LuckySelector::Offer(FrameRef&& frame)
+{
+    seen++;
+    totalSeen++;
+    if ((int)heap.size() < capacity)
+    {
+        heap.push_back(std::move(frame));
+        std::push_heap(heap.begin(), heap.end(), Sharper);
+        return;
+    }
+    if (!Sharper(frame, heap.front()))
+        return;
+    // the worst kept frame is released back to the pool
+    std::pop_heap(heap.begin(), heap.end(), Sharper);
+    heap.back() = std::move(frame);
+    std::push_heap(heap.begin(), heap.end(), Sharper);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include "framering.h"
+#include "threadpool.h"
+
+// Per-frame sharpness for lucky imaging: the variance of the Laplacian over
+// a square region that follows the brightness centroid (the planet),
+// divided by the region's squared mean so that transparency changes don't
+// count as seeing. Higher is sharper.
+class Sharpness
+{
+    public:
+    // roiSize 0 scores the whole frame.
+    explicit Sharpness(int roiSize = 256);
+
+    void SetEnabled(bool on) { enabled = on; }
+    bool Enabled() const { return enabled; }
+
+    // Capture thread.
+    double Score(Frame const& frame, ThreadPool& pool);
+    double LastScore() const { return lastScore; }
+
+    private:
+    int roiSize;
+    std::atomic<bool> enabled;
+    std::atomic<double> lastScore;
+};
+
+// Keeps the sharpest keepFraction of every window of burst frames. The kept
+// frames are a bounded min-heap on score, so a better frame evicts the worst
+// one as soon as it arrives and no more than Capacity() frames are ever
+// held. The heap is reserved up front; offering and flushing never allocate.
+class LuckySelector
+{
+    public:
+    LuckySelector(int window, double keepFraction);
+
+    void SetEnabled(bool on) { enabled = on; }
+    bool Enabled() const { return enabled; }
+    int Window() const { return window; }
+    double KeepFraction() const { return keepFraction; }
+    // Frames held at most, which the capture pool has to provide.
+    int Capacity() const { return capacity; }
+
+    // Capture thread. Frames carry their score in Frame::sharpness.
+    void Offer(FrameRef&& frame);
+    bool WindowFull() const { return seen >= window; }
+    size_t Held() const { return heap.size(); }
+    // Frames that count more burst frames will yield.
+    int Expected(int count) const { return (int)std::ceil(count * keepFraction); }
+    // Passes the keepers of the window so far to func(frame, left), in
+    // capture order, with left the number still to follow in this flush.
+    // Only the best keepFraction of a partial window is kept.
+    template<typename Func>
+        void Flush(Func const& func)
+        {
+            while ((int)heap.size() > Expected(seen))
+            {
+                std::pop_heap(heap.begin(), heap.end(), Sharper);
+                heap.pop_back();
+            }
+            std::sort(heap.begin(), heap.end(),
+                    [](FrameRef const& a, FrameRef const& b) { return a->sequence < b->sequence; });
+            totalKept += heap.size();
+            for (size_t i = 0; i < heap.size(); i++)
+                func(std::move(heap[i]), (int)(heap.size() - 1 - i));
+            heap.clear();
+            seen = 0;
+        }
+
+    // Any thread.
+    unsigned long TotalSeen() const { return totalSeen; }
+    unsigned long TotalKept() const { return totalKept; }
+
+    private:
+    // as the heap's less-than, this puts the least sharp kept frame on top
+    static bool Sharper(FrameRef const& a, FrameRef const& b) { return a->sharpness > b->sharpness; }
+
+    int window;
+    double keepFraction;
+    int capacity;
+    int seen = 0;
+    std::vector<FrameRef> heap;
+    std::atomic<bool> enabled;
+    std::atomic<unsigned long> totalSeen;
+    std::atomic<unsigned long> totalKept;
+};
@@ -1,207 +1,41 @@
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <fstream>
 #include <ctime>
 #include <vector>
 #include <stdexcept>
 #include <limits>
 #include <thread>
-#include <lucamapi.h>
-#include <fitsio.h>
+#include <memory>
+#include <algorithm>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
-
-std::runtime_error error(int status)
-{
-    return std::runtime_error(std::string("FITS file library error: code ") + std::to_string(status));
-}
-
-void WriteFits(std::string filename, std::vector<uint16_t>& pixels, int width)
-{
-    fitsfile* file = nullptr;
-    int status = 0;
-    remove(filename.c_str());
-    if (fits_create_file(&file, filename.c_str(), &status))
-        throw error(status);
-    long axes[] = { width, (long)pixels.size() / width };
-    if (fits_create_img(file, USHORT_IMG, 2, axes, &status))
-        throw error(status);
-    std::vector<long> firstpix(2);
-    for (unsigned long i = 0; i < firstpix.size(); i++)
-        firstpix[i] = 1;
-    if (fits_write_pix(file, TUSHORT, firstpix.data(), pixels.size(), pixels.data(), &status))
-        throw error(status);
-    if (fits_close_file(file, &status))
-        throw error(status);
-    std::cout << "Saved " << filename << std::endl;
-}
-
-inline bool fileExists(std::string const& name) {
-    std::ifstream f(name.c_str());
-    if (f.good()) {
-        f.close();
-        return true;
-    } else {
-        f.close();
-        return false;
-    }   
-}
-
-void WriteFits(std::vector<uint16_t> pixels, int width)
-{
-    time_t rawtime;
-    time(&rawtime);
-    auto timeinfo = localtime(&rawtime);
-    char buffer[100];
-    std::strftime(buffer, 100, "%Y-%m-%d_%I-%M-%S", timeinfo);
-    auto prefix = "image-" + std::string(buffer);
-
-    std::string file;
-    int i = 0;
-    do
-    {
-        if (i == 0)
-            file = prefix + ".fits";
-        else
-            file = prefix + "." + std::to_string(i++) + ".fits";
-    } while (fileExists(file));
-    WriteFits(file, pixels, width);
-}
-
-static volatile bool closeLucamCamera = false;
-static volatile bool beeping = false;
-
-class LucamCamera
-{
-    _lucam* camera;
-    int width;
-    int height;
-    public:
-    volatile int numImagesTake = 0;
-    volatile double exposureLive = 1;
-    volatile double exposureImage = 10;
-    volatile bool refreshExposure = false;
-
-    LucamCamera()
-    {
-        _lucam_version_info versionInfo;
-        int versionsCount = 1;
-        if (lucam_enum_cameras(&versionInfo, &versionsCount))
-            throw std::runtime_error("Lucam error on lucam_enum_cameras");
-        if (versionsCount == 0)
-            throw std::runtime_error("No Lumenera cameras found");
-        camera = lucam_camera_open(versionInfo.minor);
-        if (camera == nullptr)
-            throw std::runtime_error("Lucam error on lucam_camera_open");
-        if (lucam_camera_reset(camera))
-            throw std::runtime_error("Lucam error on lucam_camera_reset");
-        if (lucam_set_mode(camera, LUCAM_MODE_STILL_SW_TRIGGER))
-            throw std::runtime_error("Lucam error on lucam_set_mode");
-        _lucam_frame_format format;
-        if (lucam_get_still_format(camera, &format))
-            throw std::runtime_error("Lucam error on lucam_get_still_format");
-        format.binningX = 1;
-        format.binningY = 1;
-        format.pixelformat = LUCAM_PIXEL_FORMAT_16BITS;
-        width = format.width;
-        height = format.height;
-        if (lucam_set_still_format(camera, &format))
-            throw std::runtime_error("Lucam error on lucam_set_still_format");
-        
-        SetProperty(LUCAM_PROP_TIMEOUT, -1);
-        //SetProperty(LUCAM_PROP_GAMMA, 100);
-        //SetProperty(LUCAM_PROP_CONTRAST, 100);
-        //SetProperty(LUCAM_PROP_BRIGHTNESS, 100);
-        SetProperty(LUCAM_PROP_STILL_GAIN, GAIN_MULT_FACTOR);
-        SetProperty(LUCAM_PROP_STILL_EXPOSURE, 1000000);
-    }
-
-    template<typename Callback>
-        void StreamLoop(Callback const& callback)
-        {
-            auto buffercount = lucam_get_buffer_count(camera);
-            if (lucam_enable_streaming(camera))
-                throw std::runtime_error("Lucam error on lucam_enable_streaming");
-            if (lucam_start_capture_to_buffer(camera, 0, LUCAM_PIXEL_FORMAT_16BITS))
-                throw std::runtime_error("Lucam error on lucam_start_capture_to_buffer");
-            if (lucam_start_streaming(camera))
-                throw std::runtime_error("Lucam error on lucam_start_streaming");
-
-            struct Raii {
-                _lucam* camera;
-                Raii(_lucam* camera) : camera(camera) {}
-                ~Raii()
-                {
-                    if (lucam_stop_streaming(camera))
-                        throw std::runtime_error("Lucam error on lucam_stop_streaming");
-                    if (lucam_disable_streaming(camera))
-                        throw std::runtime_error("Lucam error on lucam_disable_streaming");
-                }
-            } raii(camera);
-            auto size = lucam_get_still_frame_size(camera) / sizeof(uint16_t);
-
-            std::cout << "Camera thread running with " << buffercount << " buffers" << std::endl;
-            int oldImageCount = numImagesTake;
-            for (int buffer = 0; !closeLucamCamera; buffer = (buffer + 1) % buffercount)
-            {
-                if (lucam_start_capture_to_buffer(camera,
-                            (buffer + 1) % buffercount,
-                            LUCAM_PIXEL_FORMAT_16BITS))
-                    throw std::runtime_error("Lucam error on lucam_start_capture_to_buffer");
-                if (lucam_software_trigger(camera) < 0)
-                    throw std::runtime_error("Lucam error on lucam_software_trigger");
-                if (lucam_wait_for_capture_to_buffer(camera, buffer))
-                    throw std::runtime_error("Lucam error on lucam_wait_for_capture_to_buffer");
-                auto address = reinterpret_cast<uint16_t*>(lucam_get_buffer_address(camera, buffer));
-                callback(std::vector<uint16_t>(address, address + size), width);
-                if (numImagesTake > 0 && oldImageCount != 0)
-                {
-                    WriteFits(std::vector<uint16_t>(address, address + size), width);
-                    numImagesTake--;
-                    if (numImagesTake == 0)
-                        beeping = true;
-                }
-                if ((oldImageCount == 0) != (numImagesTake == 0))
-                {
-                    refreshExposure = true;
-                }
-                if (refreshExposure)
-                {
-                    refreshExposure = false;
-                    if (numImagesTake == 0)
-                        SetProperty(LUCAM_PROP_STILL_EXPOSURE, (LONG)(1000000 * exposureLive));
-                    else
-                        SetProperty(LUCAM_PROP_STILL_EXPOSURE, (LONG)(1000000 * exposureImage));
-                }
-                oldImageCount = numImagesTake;
-            }
-            std::cout << "Camera thread shut down" << std::endl;
-        }
-
-    void SetProperty(int property, LONG value)
-    {
-        LONG oldValue = 0;
-        ULONG oldFlags = 0;
-        if (lucam_property_get(camera, property, &oldValue, &oldFlags))
-            throw std::runtime_error("Failed to get property " + std::to_string(property));
-        LONG min, max, rvalue;
-        ULONG caps;
-        if (lucam_property_get_range(camera, property, &min, &max, &rvalue, &caps))
-            throw std::runtime_error("Lucam error in lucam_property_get_range");
-        std::cout << min << " < " << value << " < " << max << std::endl;
-        // not sure why it's <0
-        if (lucam_property_set(camera, property, value, oldFlags) < 0)
-            throw std::runtime_error("Failed to set property " + std::to_string(property));
-    }
-
-    ~LucamCamera()
-    {
-        lucam_camera_close(camera);
-    }
-};
+#include "framering.h"
+#include "fitswriter.h"
+#include "capture.h"
+#include "demosaic.h"
+#include "textrenderer.h"
+#include "lucamcamera.h"
+#include "simcamera.h"
+#include "pipeline.h"
+#include "tonemap.h"
+#include "view.h"
+#include "threadpool.h"
+#include "timing.h"
 
 struct GuiSettings
 {
     int currentSetting = 0;
+    bool showTiming = true;
+    bool showHistogram = true;
+    // black point and midtones from the frame statistics instead of gamma
+    // and dark threshold
+    bool autoStretch = false;
+    // colour filter of the sensor; with colour off the mosaic is shown grey
+    CfaPattern cfa = CfaPattern::None;
+    bool colour = true;
     static const int numSettings = 5;
     int settings[numSettings] = {
         0,
@@ -270,131 +104,328 @@ struct GuiSettings
     }
 };
 
-void DrawString(SDL_Renderer* renderer, TTF_Font* font, std::string str, int x, int y, bool outline)
+std::string CalibrationStatus(Calibration const& calibration)
 {
-    SDL_Color color;
-    color.r = 255;
-    color.g = 0;
-    color.b = 0;
-    color.a = 255;
-    auto surf = TTF_RenderText_Blended(font, str.c_str(), color);
-    if (!surf)
-        throw std::runtime_error(SDL_GetError());
-    auto texture = SDL_CreateTextureFromSurface(renderer, surf);
-    if (!texture)
-        throw std::runtime_error(SDL_GetError());
-    SDL_Rect dest;
-    dest.x = x;
-    dest.y = y;
-    dest.w = surf->w;
-    dest.h = surf->h;
-    if (SDL_RenderCopy(renderer, texture, nullptr, &dest))
-        throw std::runtime_error(SDL_GetError());
-    SDL_DestroyTexture(texture); // void
-    SDL_FreeSurface(surf); // void
-    if (outline)
-    {
-        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-        SDL_RenderDrawRect(renderer, &dest);
-    }
+    if (calibration.Combining())
+        return std::string("combining ") +
+            (calibration.Collecting() == Calibration::Master::Dark ? "dark" : "flat");
+    if (calibration.Collecting() != Calibration::Master::None)
+        return std::string("collecting ") +
+            (calibration.Collecting() == Calibration::Master::Dark ? "dark " : "flat ") +
+            std::to_string(calibration.FramesCollected()) + "/" +
+            std::to_string(calibration.FramesPerMaster());
+    if (!calibration.HasDark() && !calibration.HasFlat())
+        return "no masters";
+    auto hot = calibration.HotPixels().Count();
+    return std::string(calibration.Enabled() ? "on" : "off") +
+        (calibration.HasDark() ? " dark" : "") +
+        (calibration.HasFlat() ? " flat" : "") +
+        (hot > 0 ? ", " + std::to_string(hot) + " hot" : "");
 }
 
-void DrawSettings(SDL_Renderer* renderer, TTF_Font* font, GuiSettings const& settings, LucamCamera const& camera)
+void DrawSettings(TextRenderer& text, GuiSettings const& settings, FrameStats const& stats,
+        Capture const& capture, FitsWriter const& writer, Pipeline const& pipeline)
 {
     int y = -10;
     const int yStep = 15;
-    DrawString(renderer, font, "Gamma: " + std::to_string(settings.GetGamma()),
+    text.Draw("Gamma: " + std::to_string(settings.GetGamma()),
             10, y += yStep, settings.currentSetting == 0);
-    DrawString(renderer, font, "Dark thresh: " + std::to_string(settings.GetDarkThresh()),
+    text.Draw("Dark thresh: " + std::to_string(settings.GetDarkThresh()),
             10, y += yStep, settings.currentSetting == 1);
-    DrawString(renderer, font, "Zoom: " + std::to_string(settings.GetZoom()),
+    text.Draw("Zoom: " + std::to_string(settings.GetZoom()),
             10, y += yStep, settings.currentSetting == 2);
-    DrawString(renderer, font, "Live exposure: " + std::to_string(settings.GetLiveExposure()),
+    text.Draw("Live exposure: " + std::to_string(settings.GetLiveExposure()),
             10, y += yStep, settings.currentSetting == 3);
-    DrawString(renderer, font, "Image exposure: " + std::to_string(settings.GetImageExposure()),
+    text.Draw("Image exposure: " + std::to_string(settings.GetImageExposure()),
             10, y += yStep, settings.currentSetting == 4);
-    DrawString(renderer, font, "Num images capturing: " + std::to_string(camera.numImagesTake),
+    text.Draw("Num images capturing: " + std::to_string(capture.numImagesTake),
+            10, y += yStep, false);
+    if (capture.PretriggerCapacity() > 0)
+        text.Draw("Pre-trigger: " + std::to_string(capture.PretriggerCount()) + "/" +
+                std::to_string(capture.PretriggerCapacity()) + " frames" +
+                (capture.EventRemaining() > 0
+                 ? ", event " + std::to_string(capture.EventRemaining()) + " to go" : ""),
+                10, y += yStep, false);
+    if (auto lucky = capture.Selector())
+    {
+        char line[128];
+        if (lucky->Enabled())
+            snprintf(line, sizeof(line), "Lucky: best %.0f%% of %d, score %.4g, kept %lu/%lu",
+                    lucky->KeepFraction() * 100, lucky->Window(), pipeline.sharpness.LastScore(),
+                    lucky->TotalKept(), lucky->TotalSeen());
+        else
+            snprintf(line, sizeof(line), "Lucky: off");
+        text.Draw(line, 10, y += yStep, false);
+    }
+    text.Draw("Write queue: " + std::to_string(writer.Depth()) +
+            "/" + std::to_string(writer.MaxDepth()) +
+            " (" + std::to_string(writer.Dropped()) + " dropped)",
+            10, y += yStep, false);
+    text.Draw("Write latency: " + std::to_string(writer.LastLatency()) +
+            " ms (avg " + std::to_string(writer.AverageLatency()) + " ms)",
             10, y += yStep, false);
+    text.Draw("Calibration: " + CalibrationStatus(pipeline.calibration),
+            10, y += yStep, false);
+    text.Draw("Live stack: " + (pipeline.stacker.Enabled()
+                ? std::to_string(pipeline.stacker.Count()) + " frames" +
+                (pipeline.stacker.Clipping() ? ", clipped" : "")
+                : std::string("off")),
+            10, y += yStep, false);
+    if (pipeline.stacker.Enabled() && pipeline.registration.Enabled())
+        text.Draw("Registration: " + std::to_string(pipeline.registration.ShiftX()) +
+                ", " + std::to_string(pipeline.registration.ShiftY()) +
+                " px (peak " + std::to_string(pipeline.registration.Confidence()) + ", " +
+                std::to_string(pipeline.registration.LastMs()) + " ms)",
+                10, y += yStep, false);
+    char line[128];
+    snprintf(line, sizeof(line), "Stats: min %u max %u mean %.1f median %u MAD %.0f sat %.3f%%",
+            stats.min, stats.max, stats.mean, stats.median, stats.mad, stats.saturated * 100);
+    text.Draw(line, 10, y += yStep, false);
+    if (settings.autoStretch)
+        snprintf(line, sizeof(line), "Auto stretch: black %.0f midtone %.4f", stats.black, stats.midtone);
+    else
+        snprintf(line, sizeof(line), "Auto stretch: off");
+    text.Draw(line, 10, y += yStep, false);
+    if (settings.cfa != CfaPattern::None)
+        text.Draw(std::string("Colour: ") + CfaName(settings.cfa) + (settings.colour ? "" : ", off"),
+                10, y += yStep, false);
+}
+
+// Log-scaled histogram of the latest frame, with the black point marked.
+void DrawHistogram(SDL_Renderer* renderer, FrameStats const& stats, SDL_Rect const& box)
+{
+    int numBins = (int)stats.coarse.size();
+    double peak = std::log1p((double)*std::max_element(stats.coarse.begin(), stats.coarse.end()));
+    if (peak <= 0)
+        return;
+    std::vector<SDL_Point> points(numBins);
+    for (int i = 0; i < numBins; i++)
+    {
+        points[i].x = box.x + (int)((long)i * (box.w - 1) / (numBins - 1));
+        points[i].y = box.y + box.h - 1 - (int)(std::log1p((double)stats.coarse[i]) / peak * (box.h - 1));
+    }
+    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    SDL_RenderDrawRect(renderer, &box);
+    SDL_RenderDrawLines(renderer, points.data(), numBins);
+    int blackX = box.x + (int)(stats.black / 65535 * (box.w - 1));
+    SDL_SetRenderDrawColor(renderer, 0, 160, 255, 255);
+    SDL_RenderDrawLine(renderer, blackX, box.y, blackX, box.y + box.h - 1);
 }
 
-void DispPixels(SDL_Renderer* renderer, SDL_Texture*& texture,
-        std::vector<uint16_t> const& pixels, int width, GuiSettings const& settings,
-        int winWidth, int winHeight)
+// Half flux radius of every analysed frame since star detection was turned
+// on, scaled to the range seen, with the best so far marked.
+void DrawFocus(SDL_Renderer* renderer, TextRenderer& text, std::vector<FocusSample> const& history,
+        SDL_Rect const& box)
 {
+    char line[128];
+    if (history.empty())
+    {
+        text.Draw("Focus: waiting for a frame", box.x, box.y - 15, false);
+        return;
+    }
+    auto const& last = history.back();
+    double low = std::numeric_limits<double>::max();
+    double high = 0;
+    for (auto const& sample : history)
+    {
+        if (sample.numStars == 0)
+            continue;
+        low = std::min(low, sample.hfr);
+        high = std::max(high, sample.hfr);
+    }
+    snprintf(line, sizeof(line), "Focus: HFR %.2f FWHM %.2f px, %d stars (best HFR %.2f)",
+            last.hfr, last.fwhm, last.numStars, high > 0 ? low : 0.0);
+    text.Draw(line, box.x, box.y - 15, false);
+    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    SDL_RenderDrawRect(renderer, &box);
+    if (high <= 0)
+        return;
+    double range = std::max(high - low, 0.1);
+    // frames without stars leave a gap rather than dropping to zero
+    std::vector<SDL_Point> points;
+    auto flush = [&]()
+    {
+        if (points.size() > 1)
+            SDL_RenderDrawLines(renderer, points.data(), (int)points.size());
+        else if (points.size() == 1)
+            SDL_RenderDrawPoint(renderer, points[0].x, points[0].y);
+        points.clear();
+    };
+    int bestY = box.y + box.h - 1;
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        if (history[i].numStars == 0)
+        {
+            flush();
+            continue;
+        }
+        SDL_Point point;
+        point.x = box.x + (int)((long)i * (box.w - 1) / (StarDetector::historyLength - 1));
+        point.y = bestY - (int)((history[i].hfr - low) / range * (box.h - 1));
+        points.push_back(point);
+    }
+    flush();
+    // smaller is better, so the best focus is the bottom of the graph
+    SDL_SetRenderDrawColor(renderer, 0, 160, 255, 255);
+    SDL_RenderDrawLine(renderer, box.x, bestY, box.x + box.w - 1, bestY);
+}
+
+// Rolling p50/p99 of every stage that has run, in a column of its own.
+void DrawTiming(TextRenderer& text, int x)
+{
+    int y = -10;
+    const int yStep = 15;
+    text.Draw("Stage       p50 ms   p99 ms", x, y += yStep, false);
+    for (int i = 0; i < Timing::numStages; i++)
+    {
+        auto stage = (Timing::Stage)i;
+        auto percentiles = timing.Get(stage);
+        if (percentiles.samples == 0)
+            continue;
+        char line[64];
+        snprintf(line, sizeof(line), "%-10s %7.2f  %7.2f", Timing::Name(stage),
+                percentiles.p50, percentiles.p99);
+        text.Draw(line, x, y += yStep, false);
+    }
+}
+
+// The capture thread posts this event, once SDL is up, whenever it queues a
+// frame, so the display can sleep until there is something new to show.
+static std::atomic<Uint32> frameEvent(0);
+static std::atomic<bool> framePending(false);
+// How often the overlay statistics repaint when nothing else happens.
+static const int overlayRefreshMs = 250;
+
+void NotifyFrame()
+{
+    auto type = frameEvent.load();
+    // one wakeup in the queue is enough; the display drains all frames
+    if (type == 0 || framePending.exchange(true))
+        return;
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    SDL_PushEvent(&event);
+}
+
+void DispPixels(SDL_Renderer* renderer, SDL_Texture*& texture, ToneMap& toneMap, ViewConverter& converter,
+        ThreadPool& pool, uint16_t const* pixels, int width, int height, unsigned long sequence, bool frameChanged,
+        GuiSettings const& settings, FrameStats const& stats, int winWidth, int winHeight)
+{
+    // Only the visible part of the sensor is converted, sampled down to
+    // roughly the window size, so the work follows the displayed pixels.
+    double zoom = settings.GetZoom();
+    SDL_Rect srcRect;
+    srcRect.x = 0;
+    srcRect.y = 0;
+    srcRect.w = width;
+    srcRect.h = height;
+    if (zoom >= 0)
+    {
+        int zoomX = std::max(std::min((int)zoom, (width - 16) / 2), 0);
+        srcRect.x = zoomX;
+        srcRect.y = zoomX * height / width;
+        srcRect.w = width - zoomX * 2;
+        srcRect.h = height - zoomX * 2 * height / width;
+    }
+
+    SDL_Rect destRect;
+    destRect.x = 0;
+    destRect.y = 0;
+    auto realWinWidth = std::min(winWidth, (int)((long)winHeight * srcRect.w / srcRect.h));
+    destRect.w = std::max(realWinWidth, 1);
+    destRect.h = std::max((int)((long)realWinWidth * srcRect.h / srcRect.w), 1);
+    int step = std::max(std::min(srcRect.w / destRect.w, srcRect.h / destRect.h), 1);
+    int texWidthWanted = srcRect.w / step;
+    int texHeightWanted = srcRect.h / step;
+
+    // The texture is only rebuilt when the frame, the tone curve or the
+    // visible region changed; otherwise the last one is just redrawn.
+    static SDL_Rect convertedRect;
+    static int convertedStep = 0;
+    static bool convertedColour = false;
+    bool curveChanged = settings.autoStretch
+        ? toneMap.UpdateStretch(stats.black, stats.midtone)
+        : toneMap.Update(settings.GetGamma(), settings.GetDarkThresh());
+    bool dirty = curveChanged || frameChanged || settings.colour != convertedColour ||
+        step != convertedStep || srcRect.x != convertedRect.x || srcRect.y != convertedRect.y ||
+        srcRect.w != convertedRect.w || srcRect.h != convertedRect.h;
+
     int texAccess, texWidth, texHeight;
     Uint32 texFormat;
     if (texture)
         if (SDL_QueryTexture(texture, &texFormat, &texAccess, &texWidth, &texHeight))
             throw std::runtime_error(SDL_GetError());
-    if (texture == nullptr || texWidth != width || texHeight != (int)(pixels.size() / width))
+    if (texture == nullptr || texWidth != texWidthWanted || texHeight != texHeightWanted)
     {
+        dirty = true;
         if (texture)
             SDL_DestroyTexture(texture);
-        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24,
-                SDL_TEXTUREACCESS_STREAMING, width, pixels.size() / width);
+        // RGB888 is XRGB8888, so every texel is one aligned 32-bit store
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888,
+                SDL_TEXTUREACCESS_STREAMING, texWidthWanted, texHeightWanted);
         if (texture == nullptr)
             throw std::runtime_error(SDL_GetError());
+        texWidth = texWidthWanted;
+        texHeight = texHeightWanted;
+        converter.Reserve(texWidth, texHeight, step);
     }
+    else if (step != convertedStep)
+        converter.Reserve(texWidth, texHeight, step);
+    if (!dirty)
+    {
+        if (SDL_RenderCopy(renderer, texture, nullptr, &destRect))
+            throw std::runtime_error(SDL_GetError());
+        return;
+    }
+    convertedRect = srcRect;
+    convertedStep = step;
+    convertedColour = settings.colour;
+
+    auto toneMapStart = Timing::Now();
     uint8_t* rawpixels = nullptr;
     int pitch = 0;
     if (SDL_LockTexture(texture, nullptr, reinterpret_cast<void**>(&rawpixels), &pitch))
         throw std::runtime_error(SDL_GetError());
-    int height = pixels.size() / width;
 
-    double darkThresh = settings.GetDarkThresh();
-    double gamma = settings.GetGamma();
-    double zoom = settings.GetZoom();
-
-    for (int y = 0; y < height; y++)
+    // Band offsets are multiples of 64 bytes (16 rows, and the pitch is a
+    // multiple of four). SDL doesn't promise an aligned texture, so two
+    // workers can still share the one cache line at a band boundary, but
+    // never more than that.
+    bool colour = settings.cfa != CfaPattern::None && settings.colour;
+    converter.Convert(pixels, width, height, colour ? settings.cfa : CfaPattern::None, srcRect.x, srcRect.y,
+            step, toneMap, rawpixels, pitch, texWidth, texHeight, pool);
+    if (zoom >= 0)
     {
-        for (int x = 0; x < width; x++)
-        {
-            uint16_t pixel = pixels[y * width + x];
-            double value = ((double)pixel - darkThresh) / 65535;
-            value = pow(value, gamma);
-            uint8_t pixcol = (uint8_t)(value * 255);
-            int index = y * pitch + x * 3;
-            rawpixels[index + 0] = pixcol;
-            rawpixels[index + 1] = pixcol;
-            rawpixels[index + 2] = pixcol;
-            if ((y == height / 2 || x == width / 2) && zoom >= 0)
-            {
-                rawpixels[index] = 255;
-            }
-        }
+        // crosshair: max out the red channel along the centre row and column
+        int centreX = std::min((width / 2 - srcRect.x) / step, texWidth - 1);
+        int centreY = std::min((height / 2 - srcRect.y) / step, texHeight - 1);
+        auto row = reinterpret_cast<uint32_t*>(rawpixels + (long)centreY * pitch);
+        for (int x = 0; x < texWidth; x++)
+            row[x] |= 0xFF0000;
+        for (int y = 0; y < texHeight; y++)
+            reinterpret_cast<uint32_t*>(rawpixels + (long)y * pitch)[centreX] |= 0xFF0000;
     }
+    auto uploadStart = Timing::Now();
+    timing.Record(Timing::Stage::ToneMap, sequence, toneMapStart, uploadStart);
     SDL_UnlockTexture(texture); // void
 
-    SDL_Rect destRect;
-    destRect.x = 0;
-    destRect.y = 0;
-    auto realWinWidth = std::min(winWidth, (int)((long)winHeight * width * width / pixels.size()));
-    destRect.w = realWinWidth;
-    destRect.h = (int)((long)realWinWidth * pixels.size() / (width * width));
-    if (zoom < 0)
-    {
-        if (SDL_RenderCopy(renderer, texture, nullptr, &destRect))
-            throw std::runtime_error(SDL_GetError());
-    }
-    else
-    {
-        SDL_Rect srcRect;
-        srcRect.x = (int)zoom;
-        srcRect.y = (int)zoom * height / width;
-        srcRect.w = width - (int)zoom * 2;
-        srcRect.h = height - (int)zoom * 2 * height / width;
-        if (SDL_RenderCopy(renderer, texture, &srcRect, &destRect))
-            throw std::runtime_error(SDL_GetError());
-    }
+    if (SDL_RenderCopy(renderer, texture, nullptr, &destRect))
+        throw std::runtime_error(SDL_GetError());
+    timing.Record(Timing::Stage::Upload, sequence, uploadStart, Timing::Now());
 }
 
-bool DispLoop(std::vector<uint16_t> const& pixels, int width,
-        GuiSettings& settings, LucamCamera& camera)
+bool DispLoop(uint16_t const* pixels, int width, int height, unsigned long sequence,
+        bool frameChanged, GuiSettings& settings, Capture& capture, FitsWriter const& writer, Pipeline& pipeline,
+        ThreadPool& pool)
 {
     static SDL_Window* window = nullptr;
     static SDL_Renderer* renderer = nullptr;
     static TTF_Font* font = nullptr;
+    static std::unique_ptr<TextRenderer> text;
     static SDL_Texture* texture = nullptr;
+    static ToneMap toneMap;
+    static ViewConverter converter;
     if (!window)
     {
         if (SDL_Init(SDL_INIT_EVERYTHING))
@@ -410,6 +441,12 @@ bool DispLoop(std::vector<uint16_t> const& pixels, int width,
         font = TTF_OpenFont("/usr/share/fonts/OTF/Inconsolata.otf", 14);
         if (!font)
             throw std::runtime_error(TTF_GetError());
+        SDL_Color red = { 255, 0, 0, 255 };
+        text.reset(new TextRenderer(renderer, font, red));
+        auto type = SDL_RegisterEvents(1);
+        if (type == (Uint32)-1)
+            throw std::runtime_error(SDL_GetError());
+        frameEvent = type;
     }
 
     if (SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255))
@@ -420,16 +457,43 @@ bool DispLoop(std::vector<uint16_t> const& pixels, int width,
     int winWidth, winHeight;
     SDL_GetWindowSize(window, &winWidth, &winHeight);
 
-    DispPixels(renderer, texture, pixels, width, settings, winWidth, winHeight);
+    auto stats = pipeline.statistics.Latest();
+    DispPixels(renderer, texture, toneMap, converter, pool, pixels, width, height, sequence, frameChanged,
+            settings, stats, winWidth, winHeight);
 
-    DrawSettings(renderer, font, settings, camera);
+    DrawSettings(*text, settings, stats, capture, writer, pipeline);
+    if (settings.showHistogram)
+    {
+        SDL_Rect box = { 10, std::max(winHeight - 110, 0), 256, 100 };
+        DrawHistogram(renderer, stats, box);
+    }
+    if (pipeline.stars.Enabled())
+    {
+        SDL_Rect box = { 276, std::max(winHeight - 110, 0), 300, 100 };
+        DrawFocus(renderer, *text, pipeline.stars.History(), box);
+    }
+    if (settings.showTiming)
+        DrawTiming(*text, std::max(winWidth - 240, 320));
+    text->Flush();
 
-    SDL_RenderPresent(renderer);
+    {
+        StageTimer timer(Timing::Stage::Present, sequence);
+        SDL_RenderPresent(renderer);
+    }
+    // Sleep until a new frame, some input or the next overlay refresh, then
+    // take everything that is queued.
     SDL_Event event;
-    while (SDL_PollEvent(&event))
+    for (bool any = SDL_WaitEventTimeout(&event, overlayRefreshMs) != 0; any;
+            any = SDL_PollEvent(&event) != 0)
     {
+        if (event.type == frameEvent)
+        {
+            framePending = false;
+            continue;
+        }
         if (event.type == SDL_QUIT)
         {
+            text.reset();
             SDL_DestroyWindow(window);
             SDL_DestroyRenderer(renderer);
             TTF_CloseFont(font);
@@ -458,59 +522,368 @@ bool DispLoop(std::vector<uint16_t> const& pixels, int width,
                     settings.CycleBack();
                     break;
                 case SDLK_s:
-                    camera.numImagesTake++;
+                    capture.numImagesTake++;
+                    break;
+                case SDLK_e:
+                    capture.RequestEvent();
+                    break;
+                case SDLK_k:
+                    if (auto lucky = capture.Selector())
+                    {
+                        // the scorer is on whenever the selector is; a
+                        // frame already past it when selection starts
+                        // scores 0 and never displaces a scored one
+                        if (lucky->Enabled())
+                        {
+                            lucky->SetEnabled(false);
+                            pipeline.sharpness.SetEnabled(false);
+                        }
+                        else
+                        {
+                            pipeline.sharpness.SetEnabled(true);
+                            lucky->SetEnabled(true);
+                        }
+                    }
                     break;
                 case SDLK_b:
-                    beeping = !beeping;
+                    capture.beeping = !capture.beeping;
+                    break;
+                case SDLK_d:
+                    pipeline.calibration.RequestMaster(Calibration::Master::Dark);
+                    break;
+                case SDLK_f:
+                    pipeline.calibration.RequestMaster(Calibration::Master::Flat);
+                    break;
+                case SDLK_c:
+                    pipeline.calibration.SetEnabled(!pipeline.calibration.Enabled());
+                    break;
+                case SDLK_l:
+                    pipeline.RequestStackReset();
+                    pipeline.stacker.SetEnabled(!pipeline.stacker.Enabled());
+                    break;
+                case SDLK_r:
+                    pipeline.RequestStackReset();
+                    break;
+                case SDLK_g:
+                    pipeline.RequestStackReset();
+                    pipeline.registration.SetEnabled(!pipeline.registration.Enabled());
+                    break;
+                case SDLK_w:
+                    pipeline.stacker.RequestSave();
+                    break;
+                case SDLK_t:
+                    settings.showTiming = !settings.showTiming;
+                    break;
+                case SDLK_h:
+                    settings.showHistogram = !settings.showHistogram;
+                    break;
+                case SDLK_a:
+                    settings.autoStretch = !settings.autoStretch;
+                    break;
+                case SDLK_m:
+                    pipeline.stars.SetEnabled(!pipeline.stars.Enabled());
+                    break;
+                case SDLK_o:
+                    settings.colour = !settings.colour;
                     break;
             }
             if (settings.currentSetting == GuiSettings::LIVEEXPOSURE ||
                     settings.currentSetting == GuiSettings::IMAGEEXPOSURE)
             {
-                camera.exposureImage = settings.GetImageExposure();
-                camera.exposureLive = settings.GetLiveExposure();
-                camera.refreshExposure = true;
+                capture.exposureImage = settings.GetImageExposure();
+                capture.exposureLive = settings.GetLiveExposure();
+                capture.refreshExposure = true;
             }
         }
     }
     return false;
 }
 
-int main(int, char*[])
+struct Options
+{
+    size_t writeQueueDepth = 16;
+    FitsWriter::Policy writePolicy = FitsWriter::Policy::Block;
+    FitsWriter::Format writeFormat = FitsWriter::Format::Files;
+    FitsCompression writeCompression = FitsCompression::None;
+    int writeThreads = 1;
+    // threads in each of the display and capture pools, counting the thread
+    // that runs it; 0 splits the hardware threads between the two
+    int threads = 0;
+    int captureDepth = 0;
+    bool simulate = false;
+    SimSettings sim;
+    std::string darkFile;
+    std::string flatFile;
+    int masterFrames = 16;
+    Calibration::Combine masterCombine = Calibration::Combine::Median;
+    // hot pixels found in the dark, in robust sigmas; 0 for none
+    double hotSigma = 8;
+    double stackClip = 0;
+    int registrationSize = 256;
+    std::string traceFile;
+    // pre-trigger ring memory; with only a time span given the ring is sized
+    // from it and the expected frame rate, the simulated one by default
+    double pretriggerMb = 0;
+    double pretriggerSeconds = 0;
+    double pretriggerFps = 0;
+    // frames saved after an event; -1 for as many as the ring holds
+    int eventFrames = -1;
+    // lucky imaging: percentage of each window of burst frames to keep, 0
+    // for off
+    double luckyKeep = 0;
+    int luckyWindow = 100;
+    int luckyRoi = 256;
+    // sensor region and binning; binned in software if the camera can't
+    Readout readout;
+    // colour filter of the full sensor
+    CfaPattern cfa = CfaPattern::None;
+
+    Options(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                throw std::runtime_error("Missing value for " + arg);
+            std::string value = argv[++i];
+            if (arg == "--write-queue")
+            {
+                // Capture's pool is sized from it; the writer needs a slot
+                if (std::stoi(value) < 1)
+                    throw std::runtime_error("--write-queue needs at least 1 frame, not " + value);
+                writeQueueDepth = std::stoul(value);
+            }
+            else if (arg == "--threads")
+                threads = std::stoi(value);
+            else if (arg == "--capture-depth")
+            {
+                captureDepth = std::stoi(value);
+                sim.queueDepth = captureDepth;
+            }
+            else if (arg == "--camera" && (value == "lucam" || value == "sim"))
+                simulate = value == "sim";
+            else if (arg == "--sim-size" && value.find('x') != std::string::npos)
+            {
+                sim.width = std::stoi(value.substr(0, value.find('x')));
+                sim.height = std::stoi(value.substr(value.find('x') + 1));
+            }
+            else if (arg == "--sim-bits")
+                sim.bitDepth = std::stoi(value);
+            else if (arg == "--sim-fps")
+                sim.fps = std::stod(value);
+            else if (arg == "--sim-noise" && value == "none")
+                sim.noise = SimSettings::Noise::None;
+            else if (arg == "--sim-noise" && value == "read")
+                sim.noise = SimSettings::Noise::Read;
+            else if (arg == "--sim-noise" && value == "shot")
+                sim.noise = SimSettings::Noise::Shot;
+            else if (arg == "--sim-read-noise")
+                sim.readNoise = std::stod(value);
+            else if (arg == "--sim-sky")
+                sim.sky = std::stod(value);
+            else if (arg == "--sim-stars")
+                sim.numStars = std::stoi(value);
+            else if (arg == "--sim-drift" && value.find(',') != std::string::npos)
+            {
+                sim.driftX = std::stod(value.substr(0, value.find(',')));
+                sim.driftY = std::stod(value.substr(value.find(',') + 1));
+            }
+            else if (arg == "--roi")
+            {
+                if (sscanf(value.c_str(), "%d,%d,%d,%d", &readout.x, &readout.y,
+                            &readout.width, &readout.height) != 4 ||
+                        readout.width <= 0 || readout.height <= 0)
+                    throw std::runtime_error("Expected --roi x,y,width,height, not " + value);
+            }
+            else if (arg == "--binning")
+                readout.binning = std::stoi(value);
+            else if (arg == "--cfa")
+                cfa = ParseCfa(value);
+            else if (arg == "--dark")
+                darkFile = value;
+            else if (arg == "--flat")
+                flatFile = value;
+            else if (arg == "--master-frames")
+                masterFrames = std::stoi(value);
+            else if (arg == "--master-combine" && value == "mean")
+                masterCombine = Calibration::Combine::Mean;
+            else if (arg == "--master-combine" && value == "median")
+                masterCombine = Calibration::Combine::Median;
+            else if (arg == "--hot-sigma")
+                hotSigma = std::stod(value);
+            else if (arg == "--stack-clip")
+                stackClip = std::stod(value);
+            else if (arg == "--register-size")
+                registrationSize = std::stoi(value);
+            else if (arg == "--trace")
+                traceFile = value;
+            else if (arg == "--pretrigger-mb")
+                pretriggerMb = std::stod(value);
+            else if (arg == "--pretrigger-seconds")
+                pretriggerSeconds = std::stod(value);
+            else if (arg == "--pretrigger-fps")
+                pretriggerFps = std::stod(value);
+            else if (arg == "--event-frames")
+                eventFrames = std::stoi(value);
+            else if (arg == "--lucky-keep")
+                luckyKeep = std::stod(value);
+            else if (arg == "--lucky-window")
+                luckyWindow = std::stoi(value);
+            else if (arg == "--lucky-roi")
+                luckyRoi = std::stoi(value);
+            else if (arg == "--sim-replay")
+            {
+                simulate = true;
+                sim.replayDirectory = value;
+            }
+            else if (arg == "--write-policy" && value == "block")
+                writePolicy = FitsWriter::Policy::Block;
+            else if (arg == "--write-policy" && value == "drop")
+                writePolicy = FitsWriter::Policy::Drop;
+            else if (arg == "--write-compress" && value == "none")
+                writeCompression = FitsCompression::None;
+            else if (arg == "--write-compress" && value == "rice")
+                writeCompression = FitsCompression::Rice;
+            else if (arg == "--write-compress" && value == "hcompress")
+                writeCompression = FitsCompression::Hcompress;
+            else if (arg == "--write-threads")
+                writeThreads = std::stoi(value);
+            else if (arg == "--write-format" && value == "files")
+                writeFormat = FitsWriter::Format::Files;
+            else if (arg == "--write-format" && value == "cube")
+                writeFormat = FitsWriter::Format::Cube;
+            else if (arg == "--write-format" && value == "mef")
+                writeFormat = FitsWriter::Format::Extensions;
+            else if (arg == "--write-format" && value == "ser")
+                writeFormat = FitsWriter::Format::Ser;
+            else
+                throw std::runtime_error("Unknown argument " + arg + " " + value);
+        }
+    }
+};
+
+int main(int argc, char* argv[])
 {
     try
     {
+        Options options(argc, argv);
+        if (!options.traceFile.empty())
+            timing.OpenTrace(options.traceFile);
         std::cout.setf(std::ios_base::unitbuf); // for beeping
-        std::vector<uint16_t> pixels(255 * 255);
-        int pixelsWidth = 255;
-        for (unsigned long i = 0; i < pixels.size(); i++)
+        std::vector<uint16_t> placeholder(255 * 255);
+        for (unsigned long i = 0; i < placeholder.size(); i++)
         {
-            pixels[i] = i;
+            placeholder[i] = i;
         }
         GuiSettings settings;
-        LucamCamera camera;
+        std::unique_ptr<Camera> camera;
+        if (options.simulate)
+            camera.reset(new SimCamera(options.sim));
+        else
+            camera.reset(new LucamCamera(options.captureDepth));
+        int softwareBinning = 1;
+        if (options.readout.width > 0 || options.readout.binning != 1)
+        {
+            if (!camera->SetReadout(options.readout))
+            {
+                softwareBinning = options.readout.binning;
+                std::cout << camera->Name() << " can't bin " << softwareBinning << "x" <<
+                    softwareBinning << " on the sensor, binning in software" << std::endl;
+            }
+        }
+        // a region starting on an odd row or column sees the pattern shifted
+        settings.cfa = ShiftCfa(options.cfa, options.readout.x, options.readout.y);
+        if (settings.cfa != CfaPattern::None && options.readout.binning > 1)
+        {
+            std::cout << "Binning mixes the colour filter, showing grey" << std::endl;
+            settings.cfa = CfaPattern::None;
+        }
+        double frameBytes = (double)(camera->Width() / softwareBinning) * (camera->Height() / softwareBinning) *
+            sizeof(uint16_t);
+        int pretriggerFrames = 0;
+        if (options.pretriggerMb > 0)
+            pretriggerFrames = (int)(options.pretriggerMb * 1024 * 1024 / frameBytes);
+        else if (options.pretriggerSeconds > 0)
+        {
+            double fps = options.pretriggerFps > 0 ? options.pretriggerFps
+                : options.simulate ? options.sim.fps : 0;
+            if (fps <= 0)
+                throw std::runtime_error("--pretrigger-seconds needs --pretrigger-fps or --pretrigger-mb to size the ring");
+            // a quarter to spare in case frames come faster than expected;
+            // the ring still only keeps the last pretriggerSeconds of them
+            pretriggerFrames = (int)std::ceil(options.pretriggerSeconds * fps * 1.25);
+        }
+        if (pretriggerFrames > 0)
+            std::cout << "Pre-trigger ring: " << pretriggerFrames << " frames, " <<
+                (int)std::ceil(pretriggerFrames * frameBytes / (1024 * 1024)) << " MB" << std::endl;
+        int eventFrames = options.eventFrames >= 0 ? options.eventFrames : pretriggerFrames;
+        std::unique_ptr<LuckySelector> selector;
+        if (options.luckyKeep > 0)
+            selector.reset(new LuckySelector(options.luckyWindow, options.luckyKeep / 100));
+        // Each writer thread holds one frame while saving it on top of the
+        // queue, which has room for a flushed pre-trigger ring as well. The
+        // lucky imaging selection holds its keepers until a window is done.
+        Capture capture(*camera, options.writeQueueDepth + std::max(options.writeThreads, 1) +
+                (selector ? selector->Capacity() : 0),
+                pretriggerFrames, options.pretriggerSeconds, eventFrames, softwareBinning);
+        capture.SetSelector(selector.get());
+        FitsWriter writer(options.writeQueueDepth + pretriggerFrames, options.writePolicy,
+                options.writeFormat, options.writeCompression, options.writeThreads);
+        capture.CheckWriter(writer);
+        int poolThreads = options.threads > 0 ? options.threads
+            : std::max((int)std::thread::hardware_concurrency() / 2, 1);
+        ThreadPool pool(poolThreads);
+        Pipeline pipeline(poolThreads, options.masterFrames, options.masterCombine,
+                options.stackClip, options.registrationSize, options.luckyRoi, options.hotSigma);
+        // both run on the capture thread, one after the other
+        capture.SetBinningPool(&pipeline.pool);
+        pipeline.SetCfa(settings.cfa);
+        if (!options.darkFile.empty())
+            pipeline.calibration.LoadDark(options.darkFile);
+        if (!options.flatFile.empty())
+            pipeline.calibration.LoadFlat(options.flatFile);
+        SpscQueue<FrameRef, 2> displayQueue;
+        FrameRef displayed;
         std::thread cameraThread([&]()
                 {
-                camera.StreamLoop(
-                        [&](std::vector<uint16_t> const& vec, int imgWidth)
+                capture.StreamLoop(
+                        [&](FrameRef const& frame)
                         {
-                        pixels = vec;
-                        pixelsWidth = imgWidth;
-                        });
+                        // If the display has fallen behind, this frame is
+                        // simply dropped and its slot recycled.
+                        auto shown = pipeline.Process(frame);
+                        shown->queued = Timing::Now();
+                        displayQueue.Push(std::move(shown));
+                        NotifyFrame();
+                        }, writer);
                 });
         auto lastBeep = time(nullptr);
         while (true)
         {
             auto thisClock = time(nullptr);
-            if (difftime(thisClock, lastBeep) > 4 && beeping)
+            if (difftime(thisClock, lastBeep) > 4 && capture.beeping)
             {
                 lastBeep = thisClock;
                 std::cout << '\a';
             }
-            if (DispLoop(pixels, pixelsWidth, settings, camera))
+            FrameRef next;
+            bool fresh = false;
+            while (displayQueue.Pop(next))
+            {
+                timing.Record(Timing::Stage::Handoff, next->sequence, next->queued, Timing::Now());
+                displayed = std::move(next);
+                fresh = true;
+            }
+            bool quit = displayed
+                ? DispLoop(displayed->data(), displayed->width, displayed->height, displayed->sequence,
+                        fresh, settings, capture, writer, pipeline, pool)
+                : DispLoop(placeholder.data(), 255, 255, 0, false, settings, capture, writer, pipeline, pool);
+            if (quit)
                 break;
+            if (fresh)
+                timing.Record(Timing::Stage::Latency, displayed->sequence, displayed->captured, Timing::Now());
         }
-        closeLucamCamera = true;
+        capture.closing = true;
         cameraThread.join();
     }
     catch (std::exception const& ex)
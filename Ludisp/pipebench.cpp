@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include "capture.h"
+#include "demosaic.h"
+#include "fitswriter.h"
+#include "framering.h"
+#include "pipeline.h"
+#include "simcamera.h"
+#include "threadpool.h"
+#include "timing.h"
+#include "tonemap.h"
+#include "view.h"
+
+// End to end benchmark of the live pipeline without a camera or a window:
+// a simulated camera feeds Capture, the capture thread calibrates and
+// measures every frame as in ludisp, a consumer thread tone maps what the
+// display would show, and every frame is saved as one SER burst. Reports
+// frames per second, the per-stage percentiles and heap allocations per
+// frame for each resolution and thread count; a resolution marked /2 is
+// read out at full size and binned 2x2 in software. With --cfa the display
+// side demosaics as it would for a colour sensor. Exits with 2 if any run
+// allocated after warm-up, so a regression fails a scripted run.
+
+static std::atomic<unsigned long> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations++;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+struct Resolution
+{
+    int width;
+    int height;
+    // software binning factor, as with --binning on a camera that can't
+    int binning;
+};
+
+static std::string Name(Resolution resolution)
+{
+    auto name = std::to_string(resolution.width) + "x" + std::to_string(resolution.height);
+    return resolution.binning > 1 ? name + "/" + std::to_string(resolution.binning) : name;
+}
+
+// The display converts a window's worth of pixels, not the whole frame.
+static const int windowWidth = 1280;
+static const int windowHeight = 960;
+static const int writeQueueDepth = 8;
+
+static void RemoveFiles(std::string const& directory)
+{
+    auto dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    while (auto entry = readdir(dir))
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+            remove((directory + "/" + entry->d_name).c_str());
+    closedir(dir);
+}
+
+// Returns frames per second and sets allocationsPerFrame for the measured
+// part of the run.
+double RunPipeline(Resolution resolution, int threads, double seconds, bool write, CfaPattern cfa,
+        double& allocationsPerFrame)
+{
+    SimSettings sim;
+    sim.width = resolution.width;
+    sim.height = resolution.height;
+    sim.fps = 0;
+    SimCamera camera(sim);
+    Capture capture(camera, writeQueueDepth + 1, 0, 0, 0, resolution.binning);
+    int width = capture.Width();
+    int height = capture.Height();
+    FitsWriter writer(writeQueueDepth, FitsWriter::Policy::Drop, FitsWriter::Format::Ser,
+            FitsCompression::None, 1);
+    Pipeline pipeline(threads, 1, Calibration::Combine::Mean, 3, 256, 256, 8);
+    capture.SetBinningPool(&pipeline.pool);
+    // binning mixes the colour filter, so ludisp shows those frames grey
+    if (resolution.binning > 1)
+        cfa = CfaPattern::None;
+    size_t numPixels = (size_t)width * height;
+    // about a hundred hot pixels per megapixel, like a warm sensor
+    std::vector<float> dark(numPixels, 100.0f);
+    for (size_t i = 5003; i < numPixels; i += 9973)
+        dark[i] = 4000;
+    pipeline.calibration.SetDark(std::move(dark), width, height);
+    pipeline.calibration.SetFlat(std::vector<float>(numPixels, 30000.0f), width, height);
+    pipeline.SetCfa(cfa);
+    ThreadPool displayPool(threads);
+    ToneMap toneMap;
+    toneMap.Update(0.5, 100);
+    int step = std::max(std::min(width / windowWidth, height / windowHeight), 1);
+    int texWidth = width / step;
+    int texHeight = height / step;
+    std::vector<uint32_t> texels((size_t)texWidth * texHeight);
+    ViewConverter converter;
+    converter.Reserve(texWidth, texHeight, step);
+
+    SpscQueue<FrameRef, 2> displayQueue;
+    std::atomic<unsigned long> processed(0);
+    capture.numImagesTake = write ? 1 << 30 : 0;
+    std::thread cameraThread([&]()
+            {
+            capture.StreamLoop(
+                    [&](FrameRef const& frame)
+                    {
+                    auto shown = pipeline.Process(frame);
+                    shown->queued = Timing::Now();
+                    displayQueue.Push(std::move(shown));
+                    processed++;
+                    }, writer);
+            });
+
+    auto warmup = Timing::Now() + 500000000;
+    int64_t start = 0;
+    unsigned long startFrames = 0;
+    unsigned long startAllocations = 0;
+    unsigned long startDropped = 0;
+    FrameRef displayed;
+    while (true)
+    {
+        auto now = Timing::Now();
+        if (start == 0 && now >= warmup)
+        {
+            timing.Reset();
+            start = now;
+            startFrames = processed;
+            startAllocations = allocations;
+            startDropped = writer.Dropped();
+        }
+        if (start != 0 && now - start >= (int64_t)(seconds * 1e9))
+            break;
+        FrameRef next;
+        bool fresh = false;
+        while (displayQueue.Pop(next))
+        {
+            timing.Record(Timing::Stage::Handoff, next->sequence, next->queued, Timing::Now());
+            displayed = std::move(next);
+            fresh = true;
+        }
+        if (!fresh)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        {
+            StageTimer timer(Timing::Stage::ToneMap, displayed->sequence);
+            converter.Convert(displayed->data(), width, height, cfa, 0, 0, step, toneMap,
+                    reinterpret_cast<uint8_t*>(texels.data()), texWidth * sizeof(uint32_t), texWidth, texHeight,
+                    displayPool);
+        }
+        timing.Record(Timing::Stage::Latency, displayed->sequence, displayed->captured, Timing::Now());
+    }
+    double elapsed = (Timing::Now() - start) / 1e9;
+    unsigned long frames = processed - startFrames;
+    unsigned long allocated = allocations - startAllocations;
+    unsigned long dropped = writer.Dropped() - startDropped;
+    capture.closing = true;
+    cameraThread.join();
+    displayed = FrameRef();
+
+    double fps = frames / elapsed;
+    allocationsPerFrame = frames ? (double)allocated / frames : 0.0;
+    std::cout << Name(resolution) << ", " << threads << " threads: "
+        << std::fixed << std::setprecision(1) << fps << " fps, "
+        << std::setprecision(2) << allocationsPerFrame << " allocations/frame";
+    if (write)
+        std::cout << ", " << dropped << " writes dropped";
+    std::cout << std::endl;
+    for (int i = 0; i < Timing::numStages; i++)
+    {
+        auto stage = (Timing::Stage)i;
+        auto percentiles = timing.Get(stage);
+        if (percentiles.samples == 0)
+            continue;
+        char line[64];
+        snprintf(line, sizeof(line), "    %-10s %7.2f  %7.2f ms", Timing::Name(stage),
+                percentiles.p50, percentiles.p99);
+        std::cout << line << std::endl;
+    }
+    return fps;
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        double seconds = 2;
+        bool write = true;
+        CfaPattern cfa = CfaPattern::None;
+        for (int i = 1; i < argc; i++)
+        {
+            if (!strcmp(argv[i], "--no-write"))
+                write = false;
+            else if (!strcmp(argv[i], "--cfa") && i + 1 < argc)
+                cfa = ParseCfa(argv[++i]);
+            else
+                seconds = std::stod(argv[i]);
+        }
+        // the writer saves into the working directory
+        char directory[] = "/tmp/ludisp-pipebench-XXXXXX";
+        if (!mkdtemp(directory))
+            throw std::runtime_error("Could not create a directory for the written frames");
+        if (chdir(directory))
+            throw std::runtime_error("Could not change to " + std::string(directory));
+
+        Resolution resolutions[] = { { 640, 480, 1 }, { 1392, 1040, 1 }, { 2048, 1536, 1 }, { 4096, 3000, 1 },
+            { 4096, 3000, 2 } };
+        int threadCounts[] = { 1, 2, 4, 8 };
+        std::vector<double> fps;
+        int allocatingRuns = 0;
+        for (auto resolution : resolutions)
+        {
+            for (int threads : threadCounts)
+            {
+                double allocationsPerFrame;
+                fps.push_back(RunPipeline(resolution, threads, seconds, write, cfa, allocationsPerFrame));
+                if (allocationsPerFrame > 0)
+                    allocatingRuns++;
+                RemoveFiles(directory);
+            }
+        }
+        rmdir(directory);
+
+        std::cout << std::endl << "Frames per second" << std::endl << std::setw(12) << "";
+        for (int threads : threadCounts)
+            std::cout << std::setw(8) << threads;
+        std::cout << std::endl;
+        auto result = fps.begin();
+        for (auto resolution : resolutions)
+        {
+            std::cout << std::setw(12) << Name(resolution);
+            for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++)
+                std::cout << std::setw(8) << std::setprecision(1) << *result++;
+            std::cout << std::endl;
+        }
+        if (allocatingRuns)
+        {
+            std::cout << std::endl << allocatingRuns << " runs allocated on the heap after warm-up" << std::endl;
+            return 2;
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cout << "Exception!" << std::endl;
+        std::cout << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <memory>
+#include "calibration.h"
+#include "demosaic.h"
+#include "framering.h"
+#include "lucky.h"
+#include "registration.h"
+#include "stacker.h"
+#include "stars.h"
+#include "statistics.h"
+#include "threadpool.h"
+#include "timing.h"
+
+// Processing that runs on the capture thread between readout and the
+// display/save handoff. It has its own workers so it never waits on the
+// display thread's pool; ludisp gives each pool half the hardware threads
+// by default so together they don't oversubscribe the cores.
+class Pipeline
+{
+    // Frames produced for display rather than captured, such as the live
+    // stack. Sized like the capture pool's display share.
+    static const int numOutputSlots = 5;
+    std::unique_ptr<FramePool> outputs;
+
+    // Empty while the pool needs to grow but frames from it are still
+    // queued for display or saving; they'd dangle if it went now.
+    FrameRef AcquireOutput(int width, int height)
+    {
+        size_t size = (size_t)width * height;
+        if (!outputs || outputs->Capacity() < size)
+        {
+            if (outputs && !outputs->Idle())
+                return FrameRef();
+            outputs.reset(new FramePool(numOutputSlots, size));
+        }
+        return outputs->Acquire(width, height);
+    }
+
+    public:
+    ThreadPool pool;
+    Calibration calibration;
+    Stacker stacker;
+    Registration registration;
+    Statistics statistics;
+    StarDetector stars;
+    Sharpness sharpness;
+
+    Pipeline(int numThreads, int numMasterFrames, Calibration::Combine combine,
+            double stackClipSigma, int registrationSize, int sharpnessRoi, double hotPixelSigma)
+        : pool(numThreads), calibration(numMasterFrames, combine, hotPixelSigma),
+        stacker(stackClipSigma, 5), registration(registrationSize), sharpness(sharpnessRoi)
+    {
+    }
+
+    // Tells the stages that frames are a colour mosaic. Set before streaming.
+    void SetCfa(CfaPattern pattern)
+    {
+        registration.SetMosaic(pattern != CfaPattern::None);
+        stacker.SetCfa(pattern);
+    }
+
+    // Starts the stack over, with the next frame as the new reference.
+    void RequestStackReset()
+    {
+        stacker.RequestReset();
+        registration.RequestReset();
+    }
+
+    // Works on the frame in place, so saving sees the result too. Returns
+    // the frame to display, which is the stack while live stacking.
+    FrameRef Process(FrameRef const& frame)
+    {
+        {
+            StageTimer timer(Timing::Stage::Calibrate, frame->sequence);
+            calibration.Process(*frame, pool);
+        }
+        // focus and seeing are judged on single frames, not the stack
+        stars.Submit(*frame, pool);
+        if (sharpness.Enabled())
+        {
+            StageTimer timer(Timing::Stage::Sharpness, frame->sequence);
+            frame->sharpness = sharpness.Score(*frame, pool);
+        }
+        auto shown = stacker.Enabled() ? Stack(frame) : frame;
+        StageTimer timer(Timing::Stage::Statistics, frame->sequence);
+        statistics.Compute(*shown, pool);
+        return shown;
+    }
+
+    private:
+    FrameRef Stack(FrameRef const& frame)
+    {
+        uint16_t const* pixels = frame->data();
+        Region covered = { 0, 0, frame->width, frame->height };
+        if (registration.Enabled())
+        {
+            StageTimer timer(Timing::Stage::Register, frame->sequence);
+            pixels = registration.Align(*frame, pool);
+            covered = registration.Covered();
+        }
+        StageTimer timer(Timing::Stage::Stack, frame->sequence);
+        stacker.Add(pixels, frame->width, frame->height, covered, pool);
+        auto stacked = AcquireOutput(frame->width, frame->height);
+        if (!stacked)
+            return frame;
+        stacker.Render(stacked->data(), pool);
+        stacked->sequence = frame->sequence;
+        stacked->captured = frame->captured;
+        return stacked;
+    }
+};
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include "registration.h"
+#include "simd.h"
+
+Registration::Registration(int size)
+    : size(size), log2Size(0), enabled(true), resetRequested(false),
+    shiftX(0), shiftY(0), confidence(0), lastMs(0)
+{
+    while ((1 << log2Size) < size)
+        log2Size++;
+    if ((1 << log2Size) != size)
+        throw std::runtime_error("Registration size must be a power of two");
+    twiddles.resize(size / 2);
+    for (int i = 0; i < size / 2; i++)
+        twiddles[i] = std::polar(1.0f, (float)(-2 * M_PI * i / size));
+    // Hann window so the frame edges don't dominate the correlation
+    window.resize(size);
+    for (int i = 0; i < size; i++)
+        window[i] = (float)(0.5 - 0.5 * std::cos(2 * M_PI * i / (size - 1)));
+    // Gaussian taper over the frequency plane, about a sixth of the band wide
+    taper.resize((size_t)size * size);
+    double taperWidth = size / 6.0;
+    for (int y = 0; y < size; y++)
+    {
+        int ky = y < size / 2 ? y : y - size;
+        for (int x = 0; x < size; x++)
+        {
+            int kx = x < size / 2 ? x : x - size;
+            taper[(size_t)y * size + x] =
+                (float)std::exp(-(kx * kx + ky * ky) / (2 * taperWidth * taperWidth));
+            taperSum += taper[(size_t)y * size + x];
+        }
+    }
+    reference.resize((size_t)size * size);
+    fineReference.resize((size_t)size * size);
+    current.resize((size_t)size * size);
+    transposed.resize((size_t)size * size);
+}
+
+void Registration::Fft(Complex* row, bool inverse) const
+{
+    // iterative radix-2, in place
+    for (int i = 1, j = 0; i < size; i++)
+    {
+        int bit = size >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(row[i], row[j]);
+    }
+    for (int len = 2; len <= size; len <<= 1)
+    {
+        int step = size / len;
+        for (int i = 0; i < size; i += len)
+        {
+            for (int k = 0; k < len / 2; k++)
+            {
+                // spelled out: std::complex multiplication goes through a
+                // slow NaN-checking library call
+                auto w = twiddles[k * step];
+                float wi = inverse ? -w.imag() : w.imag();
+                auto a = row[i + k];
+                auto c = row[i + k + len / 2];
+                Complex b(c.real() * w.real() - c.imag() * wi, c.real() * wi + c.imag() * w.real());
+                row[i + k] = a + b;
+                row[i + k + len / 2] = a - b;
+            }
+        }
+    }
+}
+
+void Registration::Fft2d(std::vector<Complex>& data, bool inverse, ThreadPool& pool)
+{
+    // rows, transpose, rows again (the former columns), transpose back
+    for (int pass = 0; pass < 2; pass++)
+    {
+        pool.ParallelRows(size, 8, [&](int begin, int end)
+                {
+                for (int y = begin; y < end; y++)
+                    Fft(&data[(size_t)y * size], inverse);
+                });
+        pool.ParallelRows(size, 8, [&](int begin, int end)
+                {
+                for (int y = begin; y < end; y++)
+                    for (int x = 0; x < size; x++)
+                        transposed[(size_t)x * size + y] = data[(size_t)y * size + x];
+                });
+        data.swap(transposed);
+    }
+}
+
+void Registration::Downsample(Frame const& frame, int binning, int originX, int originY,
+        std::vector<Complex>& out, ThreadPool& pool)
+{
+    int binnedWidth = std::min((frame.width - originX) / binning, size);
+    int binnedHeight = std::min((frame.height - originY) / binning, size);
+    std::fill(out.begin(), out.end(), Complex(0, 0));
+    auto pixels = frame.data();
+    pool.ParallelRows(binnedHeight, 8, [&](int begin, int end)
+            {
+            for (int by = begin; by < end; by++)
+            {
+                for (int bx = 0; bx < binnedWidth; bx++)
+                {
+                    uint32_t sum = 0;
+                    for (int y = originY + by * binning; y < originY + (by + 1) * binning; y++)
+                    {
+                        auto row = pixels + (size_t)y * frame.width + originX + bx * binning;
+                        for (int x = 0; x < binning; x++)
+                            sum += row[x];
+                    }
+                    out[(size_t)by * size + bx] = Complex((float)sum, 0);
+                }
+            }
+            });
+    double mean = 0;
+    for (int y = 0; y < binnedHeight; y++)
+        for (int x = 0; x < binnedWidth; x++)
+            mean += out[(size_t)y * size + x].real();
+    mean /= (double)binnedWidth * binnedHeight;
+    // the window is stretched over the binned image, not the padded square
+    for (int y = 0; y < binnedHeight; y++)
+    {
+        float wy = window[(size_t)y * (size - 1) / std::max(binnedHeight - 1, 1)];
+        for (int x = 0; x < binnedWidth; x++)
+        {
+            float wx = window[(size_t)x * (size - 1) / std::max(binnedWidth - 1, 1)];
+            auto& value = out[(size_t)y * size + x];
+            value = Complex((value.real() - (float)mean) * wx * wy, 0);
+        }
+    }
+}
+
+// One output row of the bilinear shift: w holds the four corner weights.
+static void ResampleRowScalar(uint16_t const* row0, uint16_t const* row1, uint16_t* out,
+        int count, float const* w)
+{
+    for (int x = 0; x < count; x++)
+        out[x] = (uint16_t)(w[0] * row0[x] + w[1] * row0[x + 1] +
+                w[2] * row1[x] + w[3] * row1[x + 1] + 0.5f);
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void ResampleRowSse2(uint16_t const* row0, uint16_t const* row1, uint16_t* out,
+        int count, float const* w)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 w00 = _mm_set1_ps(w[0]);
+    const __m128 w01 = _mm_set1_ps(w[1]);
+    const __m128 w10 = _mm_set1_ps(w[2]);
+    const __m128 w11 = _mm_set1_ps(w[3]);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    auto load = [&](uint16_t const* p, __m128& lo, __m128& hi)
+    {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+        lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+        hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero));
+    };
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128 a0, a1, b0, b1, c0, c1, d0, d1;
+        load(row0 + x, a0, a1);
+        load(row0 + x + 1, b0, b1);
+        load(row1 + x, c0, c1);
+        load(row1 + x + 1, d0, d1);
+        __m128 lo = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, w00), _mm_mul_ps(b0, w01)),
+                _mm_add_ps(_mm_mul_ps(c0, w10), _mm_mul_ps(d0, w11)));
+        __m128 hi = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a1, w00), _mm_mul_ps(b1, w01)),
+                _mm_add_ps(_mm_mul_ps(c1, w10), _mm_mul_ps(d1, w11)));
+        // weights sum to one, so the result is already within 0..65535
+        __m128i loInt = _mm_sub_epi32(_mm_cvtps_epi32(lo), bias);
+        __m128i hiInt = _mm_sub_epi32(_mm_cvtps_epi32(hi), bias);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                _mm_xor_si128(_mm_packs_epi32(loInt, hiInt), flip));
+    }
+    ResampleRowScalar(row0 + x, row1 + x, out + x, count - x, w);
+}
+
+TARGET_AVX2 static inline __m256 LoadFloats(uint16_t const* p)
+{
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+}
+
+TARGET_AVX2 static void ResampleRowAvx2(uint16_t const* row0, uint16_t const* row1, uint16_t* out,
+        int count, float const* w)
+{
+    const __m256 w00 = _mm256_set1_ps(w[0]);
+    const __m256 w01 = _mm256_set1_ps(w[1]);
+    const __m256 w10 = _mm256_set1_ps(w[2]);
+    const __m256 w11 = _mm256_set1_ps(w[3]);
+    int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+        __m256 lo = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(LoadFloats(row0 + x), w00), _mm256_mul_ps(LoadFloats(row0 + x + 1), w01)),
+                _mm256_add_ps(_mm256_mul_ps(LoadFloats(row1 + x), w10), _mm256_mul_ps(LoadFloats(row1 + x + 1), w11)));
+        __m256 hi = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(LoadFloats(row0 + x + 8), w00), _mm256_mul_ps(LoadFloats(row0 + x + 9), w01)),
+                _mm256_add_ps(_mm256_mul_ps(LoadFloats(row1 + x + 8), w10), _mm256_mul_ps(LoadFloats(row1 + x + 9), w11)));
+        __m256i packed = _mm256_packus_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    ResampleRowScalar(row0 + x, row1 + x, out + x, count - x, w);
+}
+#endif
+
+void Registration::Resample(Frame const& frame, double dx, double dy, ThreadPool& pool)
+{
+    // out(x, y) = in(x + dx, y + dy); the weights are the same everywhere
+    int ix = (int)std::floor(dx);
+    int iy = (int)std::floor(dy);
+    float fx = (float)(dx - ix);
+    float fy = (float)(dy - iy);
+    float weights[] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+    auto level = DetectSimd();
+    int w = frame.width;
+    int h = frame.height;
+    auto pixels = frame.data();
+    // Output pixels whose source pixels are all inside the frame. A whole
+    // pixel shift doesn't need the next row or column, so it keeps the far
+    // edge; the vector kernels still read one column on, so that edge
+    // column is done separately.
+    int spanX = fx > 0 ? 1 : 0;
+    int spanY = fy > 0 ? 1 : 0;
+    covered.x0 = std::min(std::max(-ix, 0), w);
+    covered.x1 = std::max(std::min(w - ix - spanX, w), covered.x0);
+    covered.y0 = std::min(std::max(-iy, 0), h);
+    covered.y1 = std::max(std::min(h - iy - spanY, h), covered.y0);
+    int x0 = covered.x0;
+    int x1 = covered.x1;
+    int kernelEnd = std::max(std::min(x1, w - ix - 1), x0);
+    pool.ParallelRows(h, 16, [&](int begin, int end)
+            {
+            for (int y = begin; y < end; y++)
+            {
+                auto out = &aligned[(size_t)y * w];
+                if (y < covered.y0 || y >= covered.y1)
+                {
+                    std::fill(out, out + w, 0);
+                    continue;
+                }
+                auto row0 = pixels + (size_t)(y + iy) * w + ix;
+                auto row1 = spanY ? row0 + w : row0;
+                std::fill(out, out + x0, 0);
+                switch (level)
+                {
+#if LUDISP_X86
+                    case SimdLevel::Avx2:
+                        ResampleRowAvx2(row0 + x0, row1 + x0, out + x0, kernelEnd - x0, weights);
+                        break;
+                    case SimdLevel::Sse2:
+                        ResampleRowSse2(row0 + x0, row1 + x0, out + x0, kernelEnd - x0, weights);
+                        break;
+#endif
+                    default:
+                        ResampleRowScalar(row0 + x0, row1 + x0, out + x0, kernelEnd - x0, weights);
+                        break;
+                }
+                for (int x = kernelEnd; x < x1; x++)
+                    out[x] = (uint16_t)(weights[0] * row0[x] + weights[2] * row1[x] + 0.5f);
+                std::fill(out + x1, out + w, 0);
+            }
+            });
+}
+
+double Registration::Correlate(std::vector<Complex> const& ref, double& peakX, double& peakY,
+        ThreadPool& pool)
+{
+    Fft2d(current, false, pool);
+    // normalized cross-power spectrum: only the phase difference is kept,
+    // tapered so that noise at high frequencies doesn't break up the peak
+    for (size_t i = 0; i < current.size(); i++)
+    {
+        auto a = ref[i];
+        auto b = current[i];
+        float re = a.real() * b.real() + a.imag() * b.imag();
+        float im = a.imag() * b.real() - a.real() * b.imag();
+        float magnitude = std::sqrt(re * re + im * im);
+        float scale = magnitude > 1e-20f ? taper[i] / magnitude : 0.0f;
+        current[i] = Complex(re * scale, im * scale);
+    }
+    Fft2d(current, true, pool);
+
+    size_t peak = 0;
+    for (size_t i = 1; i < current.size(); i++)
+        if (current[i].real() > current[peak].real())
+            peak = i;
+    int px = (int)(peak % size);
+    int py = (int)(peak / size);
+    auto at = [&](int x, int y)
+    {
+        return current[(size_t)((y + size) % size) * size + (x + size) % size].real();
+    };
+    // the taper makes the peak roughly Gaussian, so a parabola through the
+    // logs of the neighbours gives the sub-pixel position
+    auto refine = [](float left, float centre, float right)
+    {
+        if (left <= 0 || centre <= 0 || right <= 0)
+        {
+            float denominator = 2 * centre - left - right;
+            return denominator > 0 ? (right - left) / (2 * denominator) : 0.0f;
+        }
+        float l = std::log(left);
+        float c = std::log(centre);
+        float r = std::log(right);
+        float denominator = 2 * c - l - r;
+        return denominator > 0 ? (r - l) / (2 * denominator) : 0.0f;
+    };
+    peakX = px + refine(at(px - 1, py), at(px, py), at(px + 1, py));
+    peakY = py + refine(at(px, py - 1), at(px, py), at(px, py + 1));
+    if (peakX >= size / 2)
+        peakX -= size;
+    if (peakY >= size / 2)
+        peakY -= size;
+    // the inverse FFT is unscaled; a perfect match peaks at the taper's sum
+    return at(px, py) / taperSum;
+}
+
+uint16_t const* Registration::Align(Frame const& frame, ThreadPool& pool)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (resetRequested.exchange(false) || frame.width != width || frame.height != height)
+    {
+        width = frame.width;
+        height = frame.height;
+        factor = std::max((std::max(width, height) + size - 1) / size, 1);
+        fineX = std::max((width - size) / 2, 0);
+        fineY = std::max((height - size) / 2, 0);
+        aligned.resize((size_t)width * height);
+        hasReference = false;
+    }
+    if (!hasReference)
+    {
+        Downsample(frame, factor, 0, 0, reference, pool);
+        Fft2d(reference, false, pool);
+        Downsample(frame, 1, fineX, fineY, fineReference, pool);
+        Fft2d(fineReference, false, pool);
+        hasReference = true;
+        shiftX = 0;
+        shiftY = 0;
+        confidence = 1;
+        covered = { 0, 0, width, height };
+        return frame.data();
+    }
+
+    // coarse: the whole frame binned down to the FFT size
+    double peakX, peakY;
+    Downsample(frame, factor, 0, 0, current, pool);
+    double coarseConfidence = Correlate(reference, peakX, peakY, pool);
+    // the peak sits at minus the offset of the frame from the reference
+    double dx = -peakX * factor;
+    double dy = -peakY * factor;
+    confidence = coarseConfidence;
+
+    // fine: a full resolution crop from the middle of the frame, taken where
+    // the coarse estimate says the reference crop moved to
+    if (factor > 1)
+    {
+        int cropX = fineX + (int)std::lround(dx);
+        int cropY = fineY + (int)std::lround(dy);
+        if (cropX >= 0 && cropY >= 0 && cropX + size <= width && cropY + size <= height)
+        {
+            Downsample(frame, 1, cropX, cropY, current, pool);
+            double fineConfidence = Correlate(fineReference, peakX, peakY, pool);
+            // trust it only if it found a peak within the coarse uncertainty
+            if (fineConfidence > 0.1 && std::abs(peakX) <= factor && std::abs(peakY) <= factor)
+            {
+                dx = cropX - fineX - peakX;
+                dy = cropY - fineY - peakY;
+                confidence = fineConfidence;
+            }
+        }
+    }
+    if (mosaic)
+    {
+        dx = 2 * std::round(dx / 2);
+        dy = 2 * std::round(dy / 2);
+    }
+    shiftX = dx;
+    shiftY = dy;
+    Resample(frame, dx, dy, pool);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    lastMs = elapsed.count();
+    return aligned.data();
+}
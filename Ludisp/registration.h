@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <complex>
+#include <cstdint>
+#include <vector>
+#include "framering.h"
+#include "threadpool.h"
+
+// Aligns frames to a reference before stacking. The translation is found by
+// phase correlation on a binned, windowed copy of the whole frame, then
+// refined on a full resolution crop from the middle of the frame, and the
+// frame is shifted with bilinear resampling. Rotation is not corrected.
+class Registration
+{
+    public:
+    // size is the FFT edge length and must be a power of two.
+    explicit Registration(int size = 256);
+
+    void SetEnabled(bool on) { enabled = on; }
+    bool Enabled() const { return enabled; }
+    void RequestReset() { resetRequested = true; }
+    // For colour sensors: shifts are rounded to whole 2x2 filter cells, so
+    // the aligned frame is still a mosaic with the same pattern. Set before
+    // streaming.
+    void SetMosaic(bool on) { mosaic = on; }
+
+    // Returns the frame's pixels shifted onto the reference. The first frame
+    // after a reset becomes the reference and is returned as is. The result
+    // stays valid until the next call.
+    uint16_t const* Align(Frame const& frame, ThreadPool& pool);
+    // The part of the last aligned frame that came from inside the frame.
+    // The rest would have been shifted in from outside; it is filled with 0
+    // and must not be stacked.
+    Region Covered() const { return covered; }
+
+    double ShiftX() const { return shiftX; }
+    double ShiftY() const { return shiftY; }
+    // Height of the normalized correlation peak; near 0 means no match.
+    double Confidence() const { return confidence; }
+    double LastMs() const { return lastMs; }
+
+    private:
+    typedef std::complex<float> Complex;
+
+    void Downsample(Frame const& frame, int binning, int originX, int originY,
+            std::vector<Complex>& out, ThreadPool& pool);
+    double Correlate(std::vector<Complex> const& ref, double& peakX, double& peakY, ThreadPool& pool);
+    void Fft2d(std::vector<Complex>& data, bool inverse, ThreadPool& pool);
+    void Fft(Complex* row, bool inverse) const;
+    void Resample(Frame const& frame, double dx, double dy, ThreadPool& pool);
+
+    int size;
+    int log2Size;
+    int factor = 1;
+    int fineX = 0;
+    int fineY = 0;
+    int width = 0;
+    int height = 0;
+    bool hasReference = false;
+    std::vector<Complex> reference;
+    std::vector<Complex> fineReference;
+    std::vector<Complex> current;
+    std::vector<Complex> twiddles;
+    std::vector<Complex> transposed;
+    std::vector<float> window;
+    std::vector<float> taper;
+    double taperSum = 0;
+    std::vector<uint16_t> aligned;
+    Region covered = { 0, 0, 0, 0 };
+
+    bool mosaic = false;
+    std::atomic<bool> enabled;
+    std::atomic<bool> resetRequested;
+    std::atomic<double> shiftX;
+    std::atomic<double> shiftY;
+    std::atomic<double> confidence;
+    std::atomic<double> lastMs;
+};
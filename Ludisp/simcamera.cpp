@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+#include <fitsio.h>
+#include "fitsdirect.h"
+#include "fitswriter.h"
+#include "simcamera.h"
+
+static uint32_t XorShift(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double Uniform(uint32_t& state)
+{
+    return (XorShift(state) + 0.5) / 4294967296.0;
+}
+
+// At most this many replay files are mapped at once; a longer directory
+// remaps them as the replay comes round again.
+static const size_t maxReplayMaps = 32;
+
+// Closes a cfitsio file on every way out of the scope.
+struct FitsFileGuard
+{
+    fitsfile* file = nullptr;
+
+    FitsFileGuard() {}
+    FitsFileGuard(FitsFileGuard const&) = delete;
+    FitsFileGuard& operator=(FitsFileGuard const&) = delete;
+    ~FitsFileGuard()
+    {
+        int status = 0;
+        if (file)
+            fits_close_file(file, &status);
+    }
+
+    // Closes now, so an error closing is reported.
+    void Close()
+    {
+        int status = 0;
+        auto closing = file;
+        file = nullptr;
+        if (fits_close_file(closing, &status))
+            throw error(status);
+    }
+};
+
+static bool IsFitsName(std::string const& name)
+{
+    auto dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    auto ext = name.substr(dot);
+    return ext == ".fits" || ext == ".fit" || ext == ".fts";
+}
+
+SimCamera::SimCamera(SimSettings const& settings)
+    : settings(settings), width(settings.width), height(settings.height)
+{
+    if (settings.bitDepth < 1 || settings.bitDepth > 16)
+        throw std::runtime_error("Simulated bit depth must be between 1 and 16");
+
+    if (!settings.replayDirectory.empty())
+    {
+        auto dir = opendir(settings.replayDirectory.c_str());
+        if (!dir)
+            throw std::runtime_error("Cannot open replay directory " + settings.replayDirectory);
+        while (auto entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (IsFitsName(name))
+                replayFiles.push_back(settings.replayDirectory + "/" + name);
+        }
+        closedir(dir);
+        if (replayFiles.empty())
+            throw std::runtime_error("No FITS files in " + settings.replayDirectory);
+        std::sort(replayFiles.begin(), replayFiles.end());
+        replayMaps.resize(replayFiles.size());
+
+        FitsFileGuard fits;
+        int status = 0;
+        if (fits_open_file(&fits.file, replayFiles[0].c_str(), READONLY, &status))
+            throw error(status);
+        int bitpix, naxis;
+        long axes[2] = { 0, 0 };
+        if (fits_get_img_param(fits.file, 2, &bitpix, &naxis, axes, &status))
+            throw error(status);
+        fits.Close();
+        width = sensorWidth = axes[0];
+        height = sensorHeight = axes[1];
+        return;
+    }
+
+    sensorWidth = width;
+    sensorHeight = height;
+    // the star field is fixed; only its offset and the noise change
+    uint32_t state = 88172645u;
+    for (int i = 0; i < settings.numStars; i++)
+    {
+        Star star;
+        star.x = Uniform(state) * width;
+        star.y = Uniform(state) * height;
+        // few bright stars, many faint ones
+        star.flux = 2000 / std::pow(Uniform(state) + 0.01, 1.5);
+        stars.push_back(star);
+    }
+
+    // Box-Muller once up front; per pixel noise is then a table lookup
+    normals.resize(4096);
+    for (size_t i = 0; i < normals.size(); i += 2)
+    {
+        double r = std::sqrt(-2 * std::log(Uniform(state)));
+        double theta = 2 * M_PI * Uniform(state);
+        normals[i] = (float)(r * std::cos(theta));
+        normals[i + 1] = (float)(r * std::sin(theta));
+    }
+
+    // noise sigma in 16-bit units, indexed by the 16-bit noiseless value
+    int shift = 16 - settings.bitDepth;
+    sigmas.resize(65536);
+    for (int value = 0; value < 65536; value++)
+    {
+        double native = (double)value / (1 << shift);
+        double variance = 0;
+        if (settings.noise != SimSettings::Noise::None)
+            variance += settings.readNoise * settings.readNoise;
+        if (settings.noise == SimSettings::Noise::Shot)
+            variance += native;
+        sigmas[value] = (float)(std::sqrt(variance) * (1 << shift));
+    }
+}
+
+std::string SimCamera::Name() const
+{
+    if (!replayFiles.empty())
+        return "Replay " + settings.replayDirectory;
+    return "Simulated " + std::to_string(width) + "x" + std::to_string(height) +
+        " " + std::to_string(settings.bitDepth) + "-bit";
+}
+
+bool SimCamera::SetReadout(Readout const& readout)
+{
+    int roiWidth = readout.width > 0 ? readout.width : sensorWidth;
+    int roiHeight = readout.height > 0 ? readout.height : sensorHeight;
+    if (readout.x < 0 || readout.y < 0 || readout.binning < 1 ||
+            readout.x + roiWidth > sensorWidth || readout.y + roiHeight > sensorHeight)
+        throw std::runtime_error("Readout region does not fit the " + std::to_string(sensorWidth) +
+                "x" + std::to_string(sensorHeight) + " sensor");
+    if (!replayFiles.empty() && (roiWidth != sensorWidth || roiHeight != sensorHeight))
+        throw std::runtime_error("Replayed frames can't be cropped to a region");
+    originX = readout.x;
+    originY = readout.y;
+    width = roiWidth;
+    height = roiHeight;
+    return readout.binning == 1;
+}
+
+void SimCamera::StartStreaming()
+{
+    exposureEnd = std::chrono::steady_clock::now();
+    handedOut.clear();
+    stale = 0;
+    std::cout << "Camera thread running with " << Name() << std::endl;
+}
+
+void SimCamera::SetExposure(double seconds)
+{
+    exposure = seconds;
+    stale = settings.queueDepth;
+}
+
+// Waits out the exposure of the next frame.
+void SimCamera::Expose()
+{
+    if (settings.fps <= 0)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    auto start = now;
+    if (settings.queueDepth > 0)
+    {
+        // exposures run back to back as long as a buffer is free; the
+        // oldest one frees up when its frame is handed out
+        start = exposureEnd;
+        if (handedOut.size() >= (size_t)settings.queueDepth)
+            start = std::max(start, handedOut.front());
+    }
+    exposureEnd = start + std::chrono::microseconds((long)(1000000 / settings.fps));
+    std::this_thread::sleep_until(exposureEnd);
+}
+
+void SimCamera::Capture(uint16_t* dest)
+{
+    // frames queued before an exposure change are read out and dropped
+    for (; stale > 0; stale--)
+        Expose();
+    Expose();
+    if (replayFiles.empty())
+        Synthesize(dest);
+    else
+        Replay(dest);
+    frameIndex++;
+    if (settings.queueDepth > 0)
+    {
+        handedOut.push_back(std::chrono::steady_clock::now());
+        while (handedOut.size() > (size_t)settings.queueDepth)
+            handedOut.pop_front();
+    }
+}
+
+void SimCamera::Synthesize(uint16_t* dest)
+{
+    int shift = 16 - settings.bitDepth;
+    double maxNative = (1 << settings.bitDepth) - 1;
+    size_t size = (size_t)width * height;
+
+    uint16_t sky = (uint16_t)std::min(settings.sky * exposure, maxNative) << shift;
+    std::fill(dest, dest + size, sky);
+
+    const double psfSigma = 1.5;
+    const int radius = 6;
+    double dx = settings.driftX * frameIndex - originX;
+    double dy = settings.driftY * frameIndex - originY;
+    for (auto const& star : stars)
+    {
+        double cx = star.x + dx;
+        double cy = star.y + dy;
+        double peak = star.flux * exposure / (2 * M_PI * psfSigma * psfSigma);
+        for (int y = (int)cy - radius; y <= (int)cy + radius; y++)
+        {
+            if (y < 0 || y >= height)
+                continue;
+            for (int x = (int)cx - radius; x <= (int)cx + radius; x++)
+            {
+                if (x < 0 || x >= width)
+                    continue;
+                double r2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+                double native = (dest[(size_t)y * width + x] >> shift) +
+                    peak * std::exp(-r2 / (2 * psfSigma * psfSigma));
+                dest[(size_t)y * width + x] = (uint16_t)std::min(native, maxNative) << shift;
+            }
+        }
+    }
+
+    if (settings.noise == SimSettings::Noise::None)
+        return;
+    uint32_t state = rngState;
+    float maxValue = (float)((int)maxNative << shift);
+    for (size_t i = 0; i < size; i++)
+    {
+        float value = dest[i] + sigmas[dest[i]] * normals[XorShift(state) >> 20];
+        value = std::min(std::max(value, 0.0f), maxValue);
+        // truncate back onto the native ADC grid
+        dest[i] = (uint16_t)((int)value >> shift << shift);
+    }
+    rngState = state;
+}
+
+void SimCamera::Replay(uint16_t* dest)
+{
+    auto index = frameIndex % replayFiles.size();
+    auto const& name = replayFiles[index];
+    // Files are mapped as they come up and stay mapped for a while, so a
+    // short loop replays straight from the page cache without opening
+    // anything. Frames are read in order, so the one mapped longest ago is
+    // maxReplayMaps back.
+    auto& mapped = replayMaps[index];
+    if (!mapped)
+    {
+        if (replayMaps.size() > maxReplayMaps)
+            replayMaps[(index + replayMaps.size() - maxReplayMaps) % replayMaps.size()].reset();
+        mapped.reset(new MappedFits(name));
+    }
+    if (mapped->Supported())
+    {
+        if (mapped->Width() != width || mapped->Height() != height)
+            throw std::runtime_error(name + " does not match the size of the first replay frame");
+        mapped->Read(dest);
+        return;
+    }
+
+    FitsFileGuard fits;
+    int status = 0;
+    if (fits_open_file(&fits.file, name.c_str(), READONLY, &status))
+        throw error(status);
+    int bitpix, naxis;
+    long axes[2] = { 0, 0 };
+    if (fits_get_img_param(fits.file, 2, &bitpix, &naxis, axes, &status))
+        throw error(status);
+    if (axes[0] != width || axes[1] != height)
+        throw std::runtime_error(name + " does not match the size of the first replay frame");
+    long firstpix[2] = { 1, 1 };
+    int anynul = 0;
+    if (fits_read_pix(fits.file, TUSHORT, firstpix, (long)width * height, nullptr, dest, &anynul, &status))
+        throw error(status);
+    fits.Close();
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "camera.h"
+#include "fitsdirect.h"
+
+struct SimSettings
+{
+    enum class Noise
+    {
+        None,
+        Read,
+        Shot
+    };
+
+    int width = 4096;
+    int height = 3000;
+    int bitDepth = 12;
+    // 0 runs as fast as frames can be generated
+    double fps = 10;
+    // Frames exposed ahead of the one being read, like LucamCamera's queue.
+    // With 0 each 1/fps exposure starts only when Capture is called, so slow
+    // processing lowers the frame rate.
+    int queueDepth = 0;
+    Noise noise = Noise::Shot;
+    // in ADU at the native bit depth, per second of exposure for the sky
+    double readNoise = 4;
+    double sky = 100;
+    int numStars = 300;
+    // star field motion in pixels per frame, to exercise registration
+    double driftX = 0;
+    double driftY = 0;
+    // if set, frames are replayed from the FITS files in this directory
+    std::string replayDirectory;
+};
+
+// Camera backend that synthesizes a star field, or replays saved FITS files,
+// so the whole pipeline can run and be timed without hardware. Output is
+// deterministic for given settings.
+class SimCamera : public Camera
+{
+    struct Star
+    {
+        double x;
+        double y;
+        double flux;
+    };
+
+    SimSettings settings;
+    int width;
+    int height;
+    int sensorWidth;
+    int sensorHeight;
+    // top left of the readout region on the sensor
+    int originX = 0;
+    int originY = 0;
+    double exposure = 1;
+    unsigned long frameIndex = 0;
+    uint32_t rngState = 2463534242u;
+    std::vector<Star> stars;
+    std::vector<float> normals;
+    std::vector<float> sigmas;
+    std::vector<std::string> replayFiles;
+    std::vector<std::unique_ptr<MappedFits>> replayMaps;
+    std::chrono::steady_clock::time_point exposureEnd;
+    // when each of the last queueDepth frames was handed out, freeing its
+    // buffer for a new exposure
+    std::deque<std::chrono::steady_clock::time_point> handedOut;
+    int stale = 0;
+
+    void Expose();
+
+    void Synthesize(uint16_t* dest);
+    void Replay(uint16_t* dest);
+
+    public:
+    explicit SimCamera(SimSettings const& settings);
+
+    std::string Name() const override;
+    int Width() const override { return width; }
+    int Height() const override { return height; }
+    // Crops the synthesized field; replayed frames can only be read whole.
+    // There is no simulated on-chip binning, so that is always left to
+    // software.
+    bool SetReadout(Readout const& readout) override;
+
+    void StartStreaming() override;
+    void StopStreaming() override {}
+    void Capture(uint16_t* dest) override;
+    void SetExposure(double seconds) override;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+// Runtime CPU dispatch helpers. Kernels are compiled per instruction set
+// with target attributes, so the binary still runs on any x86-64 machine.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LUDISP_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LUDISP_X86 0
+#endif
+
+enum class SimdLevel
+{
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+inline SimdLevel DetectSimd()
+{
+#if LUDISP_X86
+    static const SimdLevel level =
+        __builtin_cpu_supports("avx2") ? SimdLevel::Avx2 :
+        __builtin_cpu_supports("sse2") ? SimdLevel::Sse2 :
+        SimdLevel::Scalar;
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+inline const char* SimdName(SimdLevel level)
+{
+    switch (level)
+    {
+        case SimdLevel::Avx2:
+            return "AVX2";
+        case SimdLevel::Sse2:
+            return "SSE2";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <iostream>
+#include "fitswriter.h"
+#include "simd.h"
+#include "stacker.h"
+
+Stacker::Stacker(double clipSigma, int warmup)
+    : clipSigma(clipSigma), warmup(std::max(warmup, 2)),
+    count(0), enabled(false), resetRequested(false), saveRequested(false), saving(false)
+{
+}
+
+Stacker::~Stacker()
+{
+    if (saver.joinable())
+        saver.join();
+}
+
+void Stacker::Reset(int newWidth, int newHeight)
+{
+    width = newWidth;
+    height = newHeight;
+    size_t size = (size_t)width * height;
+    mean.assign(size, 0.0f);
+    counts.assign(size, 0.0f);
+    if (Clipping())
+        m2.assign(size, 0.0f);
+    // the saver may still be reading the old one; Save catches up then
+    if (!saving)
+        snapshot.resize(size);
+    count = 0;
+}
+
+// Plain running mean over the frames that covered each pixel.
+static void AddMeanScalar(float* mean, float* counts, uint16_t const* pixels, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float c = counts[i] + 1;
+        counts[i] = c;
+        mean[i] += (pixels[i] - mean[i]) / c;
+    }
+}
+
+// Welford update with rejection of samples outside clip2 * variance.
+static void AddClippedScalar(float* mean, float* m2, float* counts, uint16_t const* pixels,
+        size_t n, float clip2, float warmup)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float delta = pixels[i] - mean[i];
+        float c = counts[i];
+        if (c >= warmup && delta * delta * (c - 1) > clip2 * m2[i])
+            continue;
+        counts[i] = c + 1;
+        mean[i] += delta / (c + 1);
+        m2[i] += delta * (pixels[i] - mean[i]);
+    }
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void AddMeanSse2(float* mean, float* counts, uint16_t const* pixels, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 one = _mm_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+        __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero));
+        __m128 countLo = _mm_add_ps(_mm_loadu_ps(counts + i), one);
+        __m128 countHi = _mm_add_ps(_mm_loadu_ps(counts + i + 4), one);
+        __m128 meanLo = _mm_loadu_ps(mean + i);
+        __m128 meanHi = _mm_loadu_ps(mean + i + 4);
+        _mm_storeu_ps(counts + i, countLo);
+        _mm_storeu_ps(counts + i + 4, countHi);
+        _mm_storeu_ps(mean + i, _mm_add_ps(meanLo, _mm_div_ps(_mm_sub_ps(lo, meanLo), countLo)));
+        _mm_storeu_ps(mean + i + 4, _mm_add_ps(meanHi, _mm_div_ps(_mm_sub_ps(hi, meanHi), countHi)));
+    }
+    AddMeanScalar(mean + i, counts + i, pixels + i, n - i);
+}
+
+TARGET_SSE2 static void AddClippedSse2(float* mean, float* m2, float* counts, uint16_t const* pixels,
+        size_t n, float clip2, float warmup)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 clip = _mm_set1_ps(clip2);
+    const __m128 warm = _mm_set1_ps(warmup);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i raw = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128 x = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+        __m128 m = _mm_loadu_ps(mean + i);
+        __m128 q = _mm_loadu_ps(m2 + i);
+        __m128 c = _mm_loadu_ps(counts + i);
+        __m128 delta = _mm_sub_ps(x, m);
+        __m128 spread = _mm_mul_ps(_mm_mul_ps(delta, delta), _mm_sub_ps(c, one));
+        __m128 accept = _mm_or_ps(_mm_cmplt_ps(c, warm), _mm_cmple_ps(spread, _mm_mul_ps(clip, q)));
+        __m128 newC = _mm_add_ps(c, _mm_and_ps(accept, one));
+        // rejected lanes divide by their old count but the result is masked
+        __m128 newM = _mm_add_ps(m, _mm_and_ps(accept, _mm_div_ps(delta, _mm_max_ps(newC, one))));
+        __m128 newQ = _mm_add_ps(q, _mm_and_ps(accept, _mm_mul_ps(delta, _mm_sub_ps(x, newM))));
+        _mm_storeu_ps(mean + i, newM);
+        _mm_storeu_ps(m2 + i, newQ);
+        _mm_storeu_ps(counts + i, newC);
+    }
+    AddClippedScalar(mean + i, m2 + i, counts + i, pixels + i, n - i, clip2, warmup);
+}
+
+TARGET_AVX2 static void AddMeanAvx2(float* mean, float* counts, uint16_t const* pixels, size_t n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+        __m256 c = _mm256_add_ps(_mm256_loadu_ps(counts + i), one);
+        __m256 m = _mm256_loadu_ps(mean + i);
+        _mm256_storeu_ps(counts + i, c);
+        _mm256_storeu_ps(mean + i, _mm256_add_ps(m, _mm256_div_ps(_mm256_sub_ps(x, m), c)));
+    }
+    AddMeanScalar(mean + i, counts + i, pixels + i, n - i);
+}
+
+TARGET_AVX2 static void AddClippedAvx2(float* mean, float* m2, float* counts, uint16_t const* pixels,
+        size_t n, float clip2, float warmup)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 clip = _mm256_set1_ps(clip2);
+    const __m256 warm = _mm256_set1_ps(warmup);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+        __m256 m = _mm256_loadu_ps(mean + i);
+        __m256 q = _mm256_loadu_ps(m2 + i);
+        __m256 c = _mm256_loadu_ps(counts + i);
+        __m256 delta = _mm256_sub_ps(x, m);
+        __m256 spread = _mm256_mul_ps(_mm256_mul_ps(delta, delta), _mm256_sub_ps(c, one));
+        __m256 accept = _mm256_or_ps(_mm256_cmp_ps(c, warm, _CMP_LT_OQ),
+                _mm256_cmp_ps(spread, _mm256_mul_ps(clip, q), _CMP_LE_OQ));
+        __m256 newC = _mm256_add_ps(c, _mm256_and_ps(accept, one));
+        __m256 newM = _mm256_add_ps(m, _mm256_and_ps(accept, _mm256_div_ps(delta, _mm256_max_ps(newC, one))));
+        __m256 newQ = _mm256_add_ps(q, _mm256_and_ps(accept, _mm256_mul_ps(delta, _mm256_sub_ps(x, newM))));
+        _mm256_storeu_ps(mean + i, newM);
+        _mm256_storeu_ps(m2 + i, newQ);
+        _mm256_storeu_ps(counts + i, newC);
+    }
+    AddClippedScalar(mean + i, m2 + i, counts + i, pixels + i, n - i, clip2, warmup);
+}
+#endif
+
+void Stacker::Add(uint16_t const* pixels, int frameWidth, int frameHeight, Region covered,
+        ThreadPool& pool)
+{
+    if (saveRequested && !saving && count > 0)
+    {
+        saveRequested = false;
+        Save();
+    }
+    if (resetRequested.exchange(false) || frameWidth != width || frameHeight != height)
+        Reset(frameWidth, frameHeight);
+
+    float clip2 = (float)(clipSigma * clipSigma);
+    auto level = DetectSimd();
+    pool.ParallelRows(height, 16, [&](int begin, int end)
+            {
+            bool clipping = Clipping();
+            size_t n = (size_t)(covered.x1 - covered.x0);
+            for (int y = std::max(begin, covered.y0); y < std::min(end, covered.y1) && n > 0; y++)
+            {
+                size_t offset = (size_t)y * width + covered.x0;
+                switch (level)
+                {
+#if LUDISP_X86
+                    case SimdLevel::Avx2:
+                        if (clipping)
+                            AddClippedAvx2(&mean[offset], &m2[offset], &counts[offset], pixels + offset, n, clip2, warmup);
+                        else
+                            AddMeanAvx2(&mean[offset], &counts[offset], pixels + offset, n);
+                        break;
+                    case SimdLevel::Sse2:
+                        if (clipping)
+                            AddClippedSse2(&mean[offset], &m2[offset], &counts[offset], pixels + offset, n, clip2, warmup);
+                        else
+                            AddMeanSse2(&mean[offset], &counts[offset], pixels + offset, n);
+                        break;
+#endif
+                    default:
+                        if (clipping)
+                            AddClippedScalar(&mean[offset], &m2[offset], &counts[offset], pixels + offset, n, clip2, warmup);
+                        else
+                            AddMeanScalar(&mean[offset], &counts[offset], pixels + offset, n);
+                        break;
+                }
+            }
+            });
+    count++;
+}
+
+void Stacker::Render(uint16_t* dest, ThreadPool& pool) const
+{
+    pool.ParallelRows(height, 16, [&](int begin, int end)
+            {
+            for (size_t i = (size_t)begin * width; i < (size_t)end * width; i++)
+                dest[i] = (uint16_t)std::min(std::max(mean[i] + 0.5f, 0.0f), 65535.0f);
+            });
+}
+
+// Only called once the last save has finished, so joining doesn't wait and
+// the snapshot is free to overwrite.
+void Stacker::Save()
+{
+    if (saver.joinable())
+        saver.join();
+    time_t rawtime;
+    time(&rawtime);
+    char buffer[100];
+    std::strftime(buffer, 100, "%Y-%m-%d_%I-%M-%S", localtime(&rawtime));
+    auto filename = "stack-" + std::string(buffer) + "-" + std::to_string(count) + ".fits";
+    snapshot.resize(mean.size());
+    std::copy(mean.begin(), mean.end(), snapshot.begin());
+    int saveWidth = width;
+    int saveHeight = height;
+    auto pattern = cfa;
+    saving = true;
+    saver = std::thread([=]()
+            {
+            try
+            {
+                if (pattern == CfaPattern::None)
+                    WriteFitsFloat(filename, snapshot.data(), saveWidth, saveHeight);
+                else
+                {
+                    // a one-off, so it can have every core for a moment
+                    ThreadPool pool(0);
+                    std::vector<float> rgb((size_t)saveWidth * saveHeight * 3);
+                    Demosaic(snapshot.data(), saveWidth, saveHeight, pattern, rgb.data(), pool);
+                    WriteFitsFloat(filename, rgb.data(), saveWidth, saveHeight, 3);
+                }
+            }
+            catch (std::exception const& ex)
+            {
+                std::cout << "Exception while saving stack!" << std::endl;
+                std::cout << ex.what() << std::endl;
+            }
+            saving = false;
+            });
+}
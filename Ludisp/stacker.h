@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "demosaic.h"
+#include "framering.h"
+#include "threadpool.h"
+
+// Live stack of the incoming frames. Keeps a running mean and a count per
+// pixel, and with sigma clipping also a Welford variance, so memory is a
+// fixed number of float planes however many frames go in. Pixels a shifted
+// frame doesn't cover keep their count, so the edges of a drifting stack
+// average only the frames that saw them.
+class Stacker
+{
+    public:
+    // clipSigma of 0 disables clipping; otherwise samples further than
+    // clipSigma standard deviations from the running mean are rejected once
+    // a pixel has seen warmup frames.
+    Stacker(double clipSigma, int warmup);
+    ~Stacker();
+
+    // UI thread requests, picked up by the capture thread on the next frame.
+    // A save asked for while the last one is still being written waits for
+    // it to finish.
+    void SetEnabled(bool on) { enabled = on; }
+    bool Enabled() const { return enabled; }
+    void RequestReset() { resetRequested = true; }
+    void RequestSave() { saveRequested = true; }
+    // Saved stacks of a colour sensor are demosaiced into an RGB cube with
+    // the quality path; the live stack stays a mosaic. Set before streaming.
+    void SetCfa(CfaPattern pattern) { cfa = pattern; }
+
+    int Count() const { return count; }
+    bool Clipping() const { return clipSigma > 0; }
+
+    // Accumulates the covered region of one calibrated frame in a single
+    // vector pass.
+    void Add(uint16_t const* pixels, int width, int height, Region covered, ThreadPool& pool);
+    // Writes the current mean, rounded to 16 bits, into dest.
+    void Render(uint16_t* dest, ThreadPool& pool) const;
+
+    private:
+    void Reset(int width, int height);
+    void Save();
+
+    double clipSigma;
+    int warmup;
+    CfaPattern cfa = CfaPattern::None;
+    int width = 0;
+    int height = 0;
+    std::vector<float> mean;
+    std::vector<float> m2;
+    std::vector<float> counts;
+    // copy of mean for the saver, so the stack can keep growing meanwhile
+    std::vector<float> snapshot;
+    std::atomic<int> count;
+    std::atomic<bool> enabled;
+    std::atomic<bool> resetRequested;
+    std::atomic<bool> saveRequested;
+    std::atomic<bool> saving;
+    std::thread saver;
+};
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cmath>
+#include "stars.h"
+#include "timing.h"
+
+// Background tile edge, in binned pixels.
+static const int tileSize = 32;
+// Components outside this range are noise or not stars (satellite trails,
+// the moon).
+static const int minArea = 3;
+static const int maxArea = 4000;
+// Binned value above which a star's core is clipped and its profile useless.
+static const float saturation = 60000;
+
+static double Median(std::vector<double>& values)
+{
+    if (values.empty())
+        return 0;
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+StarDetector::StarDetector(int maxSize, double thresholdSigma, int maxStars)
+    : maxSize(std::max(maxSize, 64)), thresholdSigma(thresholdSigma), maxStars(maxStars),
+    enabled(false)
+{
+    thread = std::thread([this]() { Run(); });
+}
+
+StarDetector::~StarDetector()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    wake.notify_all();
+    thread.join();
+}
+
+void StarDetector::SetEnabled(bool on)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // a new focus run starts with an empty graph
+    if (on && !enabled)
+        history.clear();
+    enabled = on;
+}
+
+void StarDetector::Submit(Frame const& frame, ThreadPool& pool)
+{
+    if (!enabled)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy)
+            return;
+    }
+    // the worker is idle, so the copy is ours until busy is set
+    binning = 1;
+    while ((frame.width + binning - 1) / binning > maxSize ||
+            (frame.height + binning - 1) / binning > maxSize)
+        binning++;
+    width = frame.width / binning;
+    height = frame.height / binning;
+    image.resize((size_t)width * height);
+    auto pixels = frame.data();
+    float scale = 1.0f / (binning * binning);
+    pool.ParallelRows(height, 8, [&](int begin, int end)
+            {
+            for (int by = begin; by < end; by++)
+            {
+                auto out = image.data() + (size_t)by * width;
+                for (int bx = 0; bx < width; bx++)
+                {
+                    uint32_t sum = 0;
+                    for (int y = by * binning; y < (by + 1) * binning; y++)
+                    {
+                        auto row = pixels + (size_t)y * frame.width + bx * binning;
+                        for (int x = 0; x < binning; x++)
+                            sum += row[x];
+                    }
+                    out[bx] = sum * scale;
+                }
+            }
+            });
+    sequence = frame.sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = true;
+    }
+    wake.notify_one();
+}
+
+std::vector<FocusSample> StarDetector::History() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::vector<FocusSample>(history.begin(), history.end());
+}
+
+void StarDetector::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [this]() { return busy || closing; });
+        if (closing)
+            return;
+        lock.unlock();
+        auto start = Timing::Now();
+        auto sample = Analyse();
+        auto end = Timing::Now();
+        sample.ms = (end - start) / 1e6;
+        timing.Record(Timing::Stage::Stars, sample.sequence, start, end);
+        lock.lock();
+        if (enabled)
+        {
+            history.push_back(sample);
+            if ((int)history.size() > historyLength)
+                history.pop_front();
+        }
+        busy = false;
+    }
+}
+
+void StarDetector::EstimateBackground()
+{
+    // Median and MAD of every tile, from every other pixel of every other
+    // row; stars cover too little of a tile to move either. The noise is
+    // the median of the tile MADs.
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<double> medians((size_t)tilesX * tilesY);
+    std::vector<double> mads(medians.size());
+    std::vector<double> values;
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            values.clear();
+            for (int y = ty * tileSize; y < std::min((ty + 1) * tileSize, height); y += 2)
+                for (int x = tx * tileSize; x < std::min((tx + 1) * tileSize, width); x += 2)
+                    values.push_back(image[(size_t)y * width + x]);
+            double median = Median(values);
+            for (auto& value : values)
+                value = std::fabs(value - median);
+            medians[(size_t)ty * tilesX + tx] = median;
+            mads[(size_t)ty * tilesX + tx] = Median(values);
+        }
+    }
+    noise = std::max(1.4826 * Median(mads), 1e-3);
+
+    // bilinear between tile centres, flat beyond the outer ones
+    background.resize(image.size());
+    for (int y = 0; y < height; y++)
+    {
+        double fy = std::min(std::max((y + 0.5) / tileSize - 0.5, 0.0), tilesY - 1.0);
+        int y0 = (int)fy;
+        int y1 = std::min(y0 + 1, tilesY - 1);
+        double wy = fy - y0;
+        for (int x = 0; x < width; x++)
+        {
+            double fx = std::min(std::max((x + 0.5) / tileSize - 0.5, 0.0), tilesX - 1.0);
+            int x0 = (int)fx;
+            int x1 = std::min(x0 + 1, tilesX - 1);
+            double wx = fx - x0;
+            double top = medians[(size_t)y0 * tilesX + x0] * (1 - wx) + medians[(size_t)y0 * tilesX + x1] * wx;
+            double bottom = medians[(size_t)y1 * tilesX + x0] * (1 - wx) + medians[(size_t)y1 * tilesX + x1] * wx;
+            background[(size_t)y * width + x] = (float)(top * (1 - wy) + bottom * wy);
+        }
+    }
+}
+
+FocusSample StarDetector::Analyse()
+{
+    FocusSample sample;
+    sample.sequence = sequence;
+    if (width < tileSize || height < tileSize)
+        return sample;
+    EstimateBackground();
+
+    float threshold = (float)(thresholdSigma * noise);
+    auto above = [&](size_t i) { return image[i] - background[i] > threshold; };
+    visited.assign(image.size(), 0);
+    stars.clear();
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        if (visited[i] || !above(i))
+            continue;
+        // flood fill one 8-connected component
+        blob.clear();
+        stack.clear();
+        stack.push_back((int)i);
+        visited[i] = 1;
+        while (!stack.empty())
+        {
+            int p = stack.back();
+            stack.pop_back();
+            blob.push_back(p);
+            int px = p % width;
+            int py = p / width;
+            for (int y = std::max(py - 1, 0); y <= std::min(py + 1, height - 1); y++)
+            {
+                for (int x = std::max(px - 1, 0); x <= std::min(px + 1, width - 1); x++)
+                {
+                    size_t q = (size_t)y * width + x;
+                    if (!visited[q] && above(q))
+                    {
+                        visited[q] = 1;
+                        stack.push_back((int)q);
+                    }
+                }
+            }
+        }
+        if ((int)blob.size() >= minArea && (int)blob.size() <= maxArea)
+            Measure();
+    }
+
+    // the brightest stars have the best signal to noise for the profile
+    std::sort(stars.begin(), stars.end(), [](Star const& a, Star const& b) { return a.flux > b.flux; });
+    if ((int)stars.size() > maxStars)
+        stars.resize(maxStars);
+    sample.numStars = (int)stars.size();
+    if (stars.empty())
+        return sample;
+    std::vector<double> values;
+    for (auto const& star : stars)
+        values.push_back(star.hfr);
+    sample.hfr = Median(values) * binning;
+    values.clear();
+    for (auto const& star : stars)
+        values.push_back(star.fwhm);
+    sample.fwhm = Median(values) * binning;
+    return sample;
+}
+
+void StarDetector::Measure()
+{
+    double flux = 0;
+    double sumX = 0;
+    double sumY = 0;
+    float peak = 0;
+    for (int p : blob)
+    {
+        double value = image[p] - background[p];
+        flux += value;
+        sumX += value * (p % width);
+        sumY += value * (p / width);
+        peak = std::max(peak, image[p]);
+    }
+    if (flux <= 0 || peak >= saturation)
+        return;
+    double cx = sumX / flux;
+    double cy = sumY / flux;
+
+    // The profile is measured in a circle twice the component's radius, so
+    // the wings below the threshold count too. Stars cut by the edge are
+    // skipped.
+    int radius = (int)std::ceil(2 * std::sqrt(blob.size() / M_PI)) + 2;
+    if (cx - radius < 0 || cy - radius < 0 || cx + radius >= width - 1 || cy + radius >= height - 1)
+        return;
+    profile.clear();
+    double total = 0;
+    double signal = 0;
+    double moment = 0;
+    for (int y = (int)cy - radius; y <= (int)cy + radius + 1; y++)
+    {
+        for (int x = (int)cx - radius; x <= (int)cx + radius + 1; x++)
+        {
+            double dx = x - cx;
+            double dy = y - cy;
+            double r2 = dx * dx + dy * dy;
+            if (r2 > (double)radius * radius)
+                continue;
+            size_t i = (size_t)y * width + x;
+            // negative noise is kept for the moment, where it averages out,
+            // but not for the enclosed flux, which must only grow
+            double value = image[i] - background[i];
+            signal += value;
+            moment += value * r2;
+            value = std::max(value, 0.0);
+            total += value;
+            profile.push_back(std::make_pair((float)std::sqrt(r2), (float)value));
+        }
+    }
+    if (total <= 0 || signal <= 0 || moment <= 0)
+        return;
+
+    // radius enclosing half the flux, interpolated between pixels
+    std::sort(profile.begin(), profile.end());
+    double enclosed = 0;
+    double hfr = radius;
+    double previousR = 0;
+    for (auto const& point : profile)
+    {
+        if (enclosed + point.second >= total / 2)
+        {
+            double t = point.second > 0 ? (total / 2 - enclosed) / point.second : 0;
+            hfr = previousR + (point.first - previousR) * t;
+            break;
+        }
+        enclosed += point.second;
+        previousR = point.first;
+    }
+    Star star;
+    star.x = cx;
+    star.y = cy;
+    star.flux = total;
+    star.hfr = hfr;
+    // sigma of a circular Gaussian from its radial second moment
+    star.fwhm = 2.3548 * std::sqrt(moment / signal / 2);
+    stars.push_back(star);
+}
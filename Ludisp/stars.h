@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "framering.h"
+#include "threadpool.h"
+
+// Focus quality of one analysed frame. Sizes are in sensor pixels and are
+// medians over the brightest stars.
+struct FocusSample
+{
+    unsigned long sequence = 0;
+    int numStars = 0;
+    double hfr = 0;   // half flux radius
+    double fwhm = 0;  // from the second moments, assuming a Gaussian profile
+    double ms = 0;    // detection time
+};
+
+// Finds stars in live frames and measures how well they are focused. The
+// capture thread bins a frame into a private copy, and only when the worker
+// is idle, so the cost per captured frame is nothing or one binning pass and
+// the analysis always works on the newest frame it can keep up with. The
+// worker subtracts a tiled median background, thresholds at a multiple of
+// the noise, labels 8-connected components and measures the brightest ones.
+class StarDetector
+{
+    public:
+    static const int historyLength = 300;
+
+    // Frames are binned until they fit in maxSize pixels on each side.
+    explicit StarDetector(int maxSize = 2048, double thresholdSigma = 5, int maxStars = 100);
+    ~StarDetector();
+    StarDetector(StarDetector const&) = delete;
+    StarDetector& operator=(StarDetector const&) = delete;
+
+    void SetEnabled(bool on);
+    bool Enabled() const { return enabled; }
+
+    // Capture thread. Skips the frame if the previous one is still being
+    // analysed.
+    void Submit(Frame const& frame, ThreadPool& pool);
+
+    // Any thread. Oldest first, at most historyLength samples since the
+    // detector was last enabled.
+    std::vector<FocusSample> History() const;
+
+    private:
+    struct Star
+    {
+        double x;
+        double y;
+        double flux;
+        double hfr;
+        double fwhm;
+    };
+
+    void Run();
+    FocusSample Analyse();
+    void EstimateBackground();
+    // Adds the component in blob to stars if it looks like a usable star.
+    void Measure();
+
+    int maxSize;
+    double thresholdSigma;
+    int maxStars;
+
+    // filled by Submit while the worker is idle, then owned by the worker
+    std::vector<float> image;
+    int width = 0;
+    int height = 0;
+    int binning = 1;
+    unsigned long sequence = 0;
+
+    // worker only
+    std::vector<float> background;
+    std::vector<uint8_t> visited;
+    std::vector<int> stack;
+    std::vector<int> blob;
+    std::vector<Star> stars;
+    // distance from the centroid and flux of each pixel around a star
+    std::vector<std::pair<float, float>> profile;
+    double noise = 0;
+
+    std::atomic<bool> enabled;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    bool busy = false;
+    bool closing = false;
+    std::deque<FocusSample> history;
+    std::thread thread;
+};
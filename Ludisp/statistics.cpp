@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cmath>
+#include "statistics.h"
+#include "tonemap.h"
+
+// Auto stretch constants as in the usual screen transfer function: clip the
+// shadows 2.8 normalized MADs below the median and put the median at a
+// quarter of the display range.
+static const double shadowsClip = -2.8;
+static const double targetBackground = 0.25;
+// MAD of a Gaussian is 0.6745 sigma
+static const double madToSigma = 1.4826;
+
+static void RangeScalar(uint16_t const* pixels, int count, uint16_t& low, uint16_t& high)
+{
+    for (int i = 0; i < count; i++)
+    {
+        low = std::min(low, pixels[i]);
+        high = std::max(high, pixels[i]);
+    }
+}
+
+static size_t CountEqualScalar(uint16_t const* pixels, int count, uint16_t value)
+{
+    size_t equal = 0;
+    for (int i = 0; i < count; i++)
+        equal += pixels[i] == value;
+    return equal;
+}
+
+#if LUDISP_X86
+TARGET_SSE2 static void RangeSse2(uint16_t const* pixels, int count, uint16_t& low, uint16_t& high)
+{
+    // SSE2 only compares signed words, so the values are biased first
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    __m128i lows = _mm_set1_epi16((short)(low ^ 0x8000));
+    __m128i highs = _mm_set1_epi16((short)(high ^ 0x8000));
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i)), flip);
+        lows = _mm_min_epi16(lows, x);
+        highs = _mm_max_epi16(highs, x);
+    }
+    alignas(16) uint16_t lanes[2][8];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes[0]), _mm_xor_si128(lows, flip));
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes[1]), _mm_xor_si128(highs, flip));
+    RangeScalar(lanes[0], 8, low, high);
+    RangeScalar(lanes[1], 8, low, high);
+    RangeScalar(pixels + i, count - i, low, high);
+}
+
+TARGET_SSE2 static size_t CountEqualSse2(uint16_t const* pixels, int count, uint16_t value)
+{
+    const __m128i target = _mm_set1_epi16((short)value);
+    size_t equal = 0;
+    int i = 0;
+    while (i + 8 <= count)
+    {
+        // matches are -1, so subtracting them counts per lane; drained
+        // before a lane can pass 32767
+        __m128i counts = _mm_setzero_si128();
+        int end = std::min(count & ~7, i + 8 * 32767);
+        for (; i < end; i += 8)
+            counts = _mm_sub_epi16(counts,
+                    _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i)), target));
+        alignas(16) int32_t sums[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums), _mm_madd_epi16(counts, _mm_set1_epi16(1)));
+        equal += (size_t)sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    return equal + CountEqualScalar(pixels + i, count - i, value);
+}
+
+TARGET_AVX2 static void RangeAvx2(uint16_t const* pixels, int count, uint16_t& low, uint16_t& high)
+{
+    __m256i lows = _mm256_set1_epi16((short)low);
+    __m256i highs = _mm256_set1_epi16((short)high);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i));
+        lows = _mm256_min_epu16(lows, x);
+        highs = _mm256_max_epu16(highs, x);
+    }
+    alignas(32) uint16_t lanes[2][16];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[0]), lows);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[1]), highs);
+    RangeScalar(lanes[0], 16, low, high);
+    RangeScalar(lanes[1], 16, low, high);
+    RangeScalar(pixels + i, count - i, low, high);
+}
+
+TARGET_AVX2 static size_t CountEqualAvx2(uint16_t const* pixels, int count, uint16_t value)
+{
+    const __m256i target = _mm256_set1_epi16((short)value);
+    size_t equal = 0;
+    int i = 0;
+    while (i + 16 <= count)
+    {
+        __m256i counts = _mm256_setzero_si256();
+        int end = std::min(count & ~15, i + 16 * 32767);
+        for (; i < end; i += 16)
+            counts = _mm256_sub_epi16(counts,
+                    _mm256_cmpeq_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i)), target));
+        alignas(32) int32_t sums[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(sums), _mm256_madd_epi16(counts, _mm256_set1_epi16(1)));
+        for (auto sum : sums)
+            equal += (size_t)sum;
+    }
+    return equal + CountEqualScalar(pixels + i, count - i, value);
+}
+#endif
+
+static void Range(uint16_t const* pixels, int count, uint16_t& low, uint16_t& high, SimdLevel level)
+{
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            RangeAvx2(pixels, count, low, high);
+            break;
+        case SimdLevel::Sse2:
+            RangeSse2(pixels, count, low, high);
+            break;
+#endif
+        default:
+            RangeScalar(pixels, count, low, high);
+            break;
+    }
+}
+
+static size_t CountEqual(uint16_t const* pixels, int count, uint16_t value, SimdLevel level)
+{
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            return CountEqualAvx2(pixels, count, value);
+        case SimdLevel::Sse2:
+            return CountEqualSse2(pixels, count, value);
+#endif
+        default:
+            return CountEqualScalar(pixels, count, value);
+    }
+}
+
+Statistics::Statistics(int maxSamples) : maxSamples(std::max(maxSamples, 1)), histogram(numBins)
+{
+}
+
+void Statistics::Compute(Frame const& frame, ThreadPool& pool)
+{
+    int width = frame.width;
+    int height = frame.height;
+    if (width <= 0 || height <= 0)
+        return;
+    int stride = (int)std::max(((size_t)width * height + maxSamples - 1) / maxSamples, (size_t)1);
+    int numRows = (height + stride - 1) / stride;
+    int numTasks = std::max(std::min(pool.Size(), numRows), 1);
+    size_t tableSize = (size_t)numTasks * 2 * numBins;
+    if (partials.size() < tableSize)
+        partials.resize(tableSize);
+    if (extremes.size() < (size_t)numTasks)
+        extremes.resize(numTasks);
+
+    auto pixels = frame.data();
+    auto level = DetectSimd();
+    pool.ParallelFor(numTasks, [&](int task)
+            {
+            auto even = partials.data() + (size_t)task * 2 * numBins;
+            auto odd = even + numBins;
+            std::fill(even, even + 2 * numBins, 0);
+            int begin = (int)((long)numRows * task / numTasks);
+            int end = (int)((long)numRows * (task + 1) / numTasks);
+            for (int r = begin; r < end; r++)
+            {
+                auto row = pixels + (size_t)r * stride * width;
+                int x = 0;
+                for (; x + 1 < width; x += 2)
+                {
+                    even[row[x]]++;
+                    odd[row[x + 1]]++;
+                }
+                if (x < width)
+                    even[row[x]]++;
+            }
+            // the range reads every row, split the same way
+            uint16_t low = 0xFFFF;
+            uint16_t high = 0;
+            int first = (int)((long)height * task / numTasks);
+            int last = (int)((long)height * (task + 1) / numTasks);
+            for (int y = first; y < last; y++)
+                Range(pixels + (size_t)y * width, width, low, high, level);
+            extremes[task].min = low;
+            extremes[task].max = high;
+            });
+    uint16_t frameMin = 0xFFFF;
+    uint16_t frameMax = 0;
+    for (int task = 0; task < numTasks; task++)
+    {
+        frameMin = std::min(frameMin, extremes[task].min);
+        frameMax = std::max(frameMax, extremes[task].max);
+    }
+    // clipped pixels pile up at the maximum; only count them if it is near
+    // full scale rather than just the brightest star
+    size_t clipped = 0;
+    if (frameMax >= 0xF000)
+    {
+        pool.ParallelFor(numTasks, [&](int task)
+                {
+                int first = (int)((long)height * task / numTasks);
+                int last = (int)((long)height * (task + 1) / numTasks);
+                size_t equal = 0;
+                for (int y = first; y < last; y++)
+                    equal += CountEqual(pixels + (size_t)y * width, width, frameMax, level);
+                extremes[task].clipped = equal;
+                });
+        for (int task = 0; task < numTasks; task++)
+            clipped += extremes[task].clipped;
+    }
+    int numTables = numTasks * 2;
+    int numChunks = pool.Size();
+    pool.ParallelFor(numChunks, [&](int chunk)
+            {
+            int begin = numBins * chunk / numChunks;
+            int end = numBins * (chunk + 1) / numChunks;
+            std::copy(partials.begin() + begin, partials.begin() + end, histogram.begin() + begin);
+            for (int table = 1; table < numTables; table++)
+            {
+                auto src = partials.data() + (size_t)table * numBins;
+                for (int b = begin; b < end; b++)
+                    histogram[b] += src[b];
+            }
+            });
+
+    // Everything else is a walk over the 65536 bins.
+    FrameStats stats;
+    stats.sequence = frame.sequence;
+    uint64_t total = (uint64_t)numRows * width;
+    uint64_t below = 0;
+    double sum = 0;
+    int median = -1;
+    for (int b = 0; b < numBins; b++)
+    {
+        uint32_t count = histogram[b];
+        stats.coarse[b * numCoarseBins / numBins] += count;
+        if (count == 0)
+            continue;
+        sum += (double)b * count;
+        below += count;
+        if (median < 0 && below * 2 >= total)
+            median = b;
+    }
+    stats.min = frameMin;
+    stats.max = frameMax;
+    stats.median = (uint16_t)median;
+    stats.mean = sum / total;
+    stats.saturated = (double)clipped / ((double)width * height);
+
+    // median absolute deviation: grow a window around the median until it
+    // holds half the samples
+    uint64_t within = histogram[median];
+    int mad = 0;
+    while (within * 2 < total)
+    {
+        mad++;
+        if (median - mad >= 0)
+            within += histogram[median - mad];
+        if (median + mad < numBins)
+            within += histogram[median + mad];
+    }
+    stats.mad = mad;
+
+    double medianN = median / 65535.0;
+    double sigmaN = madToSigma * mad / 65535.0;
+    double clip = std::min(std::max(medianN + shadowsClip * sigmaN, 0.0), 1.0);
+    stats.black = clip * 65535;
+    stats.midtone = medianN > clip ? Mtf(targetBackground, (medianN - clip) / (1 - clip)) : 0.5;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    latest = stats;
+}
+
+FrameStats Statistics::Latest() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return latest;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "framering.h"
+#include "simd.h"
+#include "threadpool.h"
+
+struct FrameStats
+{
+    unsigned long sequence = 0;
+    uint16_t min = 0;
+    uint16_t max = 0;
+    uint16_t median = 0;
+    double mean = 0;
+    // median absolute deviation, in ADU
+    double mad = 0;
+    // fraction of pixels clipped at the frame's maximum value
+    double saturated = 0;
+    // auto stretch: black point in ADU and midtones balance in (0, 1)
+    double black = 0;
+    double midtone = 0.5;
+    // the histogram folded into 256 bins for drawing
+    std::array<uint32_t, 256> coarse;
+
+    FrameStats() { coarse.fill(0); }
+};
+
+// Histogram and robust statistics of every frame, and the screen stretch
+// derived from them. The median, mean, MAD and stretch come out of one
+// 65536-bin histogram, so the per-pixel work is a single increment. Its rows
+// are sampled evenly down to maxSamples pixels, which keeps a full-size frame
+// well under a millisecond and changes the estimates by far less than the
+// noise. Min, max and saturation would miss a lone hot or clipped pixel that
+// way, so they come from a vector pass over every row instead.
+class Statistics
+{
+    public:
+    static const int numBins = 65536;
+    static const int numCoarseBins = 256;
+
+    explicit Statistics(int maxSamples = 1 << 19);
+
+    // Capture thread.
+    void Compute(Frame const& frame, ThreadPool& pool);
+    // Any thread.
+    FrameStats Latest() const;
+
+    private:
+    int maxSamples;
+    // two tables per task, so runs of equal pixels don't serialize on one
+    // counter
+    std::vector<uint32_t> partials;
+    std::vector<uint32_t> histogram;
+    // per task: range of its rows and the number at the frame maximum
+    struct Extremes
+    {
+        uint16_t min;
+        uint16_t max;
+        size_t clipped;
+    };
+    std::vector<Extremes> extremes;
+    mutable std::mutex mutex;
+    FrameStats latest;
+};
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <stdexcept>
+#include "textrenderer.h"
+
+TextRenderer::TextRenderer(SDL_Renderer* renderer, TTF_Font* font, SDL_Color color)
+    : renderer(renderer), color(color)
+{
+    // Glyphs are rendered white and tinted by the texture colour, so one
+    // atlas would serve any colour.
+    SDL_Color white = { 255, 255, 255, 255 };
+    SDL_Surface* surfaces[numGlyphs] = {};
+    int cellWidth = 1;
+    int cellHeight = 1;
+    for (int i = 0; i < numGlyphs; i++)
+    {
+        Uint16 ch = (Uint16)(firstGlyph + i);
+        int minx, maxx, miny, maxy;
+        advances[i] = 0;
+        if (TTF_GlyphMetrics(font, ch, &minx, &maxx, &miny, &maxy, &advances[i]) == 0)
+            surfaces[i] = TTF_RenderGlyph_Blended(font, ch, white);
+        if (surfaces[i])
+        {
+            cellWidth = std::max(cellWidth, surfaces[i]->w);
+            cellHeight = std::max(cellHeight, surfaces[i]->h);
+        }
+    }
+    lineHeight = std::max(TTF_FontHeight(font), cellHeight);
+
+    const int columns = 16;
+    atlasWidth = columns * cellWidth;
+    atlasHeight = (numGlyphs + columns - 1) / columns * cellHeight;
+    auto sheet = SDL_CreateRGBSurfaceWithFormat(0, atlasWidth, atlasHeight, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!sheet)
+        throw std::runtime_error(SDL_GetError());
+    for (int i = 0; i < numGlyphs; i++)
+    {
+        auto& glyph = glyphs[i];
+        glyph.x = i % columns * cellWidth;
+        glyph.y = i / columns * cellHeight;
+        glyph.w = 0;
+        glyph.h = 0;
+        if (!surfaces[i])
+            continue;
+        glyph.w = surfaces[i]->w;
+        glyph.h = surfaces[i]->h;
+        // copy alpha as is rather than blending onto the empty sheet
+        SDL_SetSurfaceBlendMode(surfaces[i], SDL_BLENDMODE_NONE);
+        SDL_Rect dest = glyph;
+        if (SDL_BlitSurface(surfaces[i], nullptr, sheet, &dest))
+            throw std::runtime_error(SDL_GetError());
+        SDL_FreeSurface(surfaces[i]);
+    }
+    atlas = SDL_CreateTextureFromSurface(renderer, sheet);
+    SDL_FreeSurface(sheet);
+    if (!atlas)
+        throw std::runtime_error(SDL_GetError());
+    SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+    SDL_SetTextureColorMod(atlas, color.r, color.g, color.b);
+}
+
+TextRenderer::~TextRenderer()
+{
+    if (atlas)
+        SDL_DestroyTexture(atlas);
+}
+
+void TextRenderer::Layout(Line& line, int x, int y) const
+{
+    line.quads.clear();
+    int pen = x;
+    for (char c : line.text)
+    {
+        int index = (unsigned char)c - firstGlyph;
+        if (index < 0 || index >= numGlyphs)
+            index = '?' - firstGlyph;
+        auto const& glyph = glyphs[index];
+        if (glyph.w > 0)
+        {
+            SDL_Rect dest = glyph;
+            dest.x = pen;
+            dest.y = y;
+            line.quads.push_back(std::make_pair(glyph, dest));
+        }
+        pen += advances[index];
+    }
+    line.bounds.x = x;
+    line.bounds.y = y;
+    line.bounds.w = pen - x;
+    line.bounds.h = lineHeight;
+}
+
+void TextRenderer::Draw(std::string const& text, int x, int y, bool outline)
+{
+    auto inserted = lines.emplace(std::make_pair(x, y), Line());
+    auto& line = inserted.first->second;
+    if (inserted.second || line.text != text)
+    {
+        line.text = text;
+        Layout(line, x, y);
+    }
+    line.outline = outline;
+    line.drawn = true;
+}
+
+void TextRenderer::Flush()
+{
+    for (auto it = lines.begin(); it != lines.end();)
+    {
+        if (it->second.drawn)
+            ++it;
+        else
+            it = lines.erase(it);
+    }
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_Color white = { 255, 255, 255, 255 };
+    batch.clear();
+    for (auto const& entry : lines)
+    {
+        for (auto const& quad : entry.second.quads)
+        {
+            auto const& src = quad.first;
+            auto const& dest = quad.second;
+            float u0 = (float)src.x / atlasWidth;
+            float v0 = (float)src.y / atlasHeight;
+            float u1 = (float)(src.x + src.w) / atlasWidth;
+            float v1 = (float)(src.y + src.h) / atlasHeight;
+            float x0 = (float)dest.x;
+            float y0 = (float)dest.y;
+            float x1 = (float)(dest.x + dest.w);
+            float y1 = (float)(dest.y + dest.h);
+            batch.push_back({ { x0, y0 }, white, { u0, v0 } });
+            batch.push_back({ { x1, y0 }, white, { u1, v0 } });
+            batch.push_back({ { x1, y1 }, white, { u1, v1 } });
+            batch.push_back({ { x0, y1 }, white, { u0, v1 } });
+        }
+    }
+    int numQuads = (int)batch.size() / 4;
+    while ((int)indices.size() < numQuads * 6)
+    {
+        int base = (int)indices.size() / 6 * 4;
+        int quad[] = { base, base + 1, base + 2, base, base + 2, base + 3 };
+        indices.insert(indices.end(), quad, quad + 6);
+    }
+    if (numQuads > 0 && SDL_RenderGeometry(renderer, atlas, batch.data(), (int)batch.size(),
+                indices.data(), numQuads * 6))
+        throw std::runtime_error(SDL_GetError());
+#else
+    // without SDL_RenderGeometry, SDL 2.0.10+ still batches consecutive
+    // copies from one texture into a single draw
+    for (auto const& entry : lines)
+        for (auto const& quad : entry.second.quads)
+            if (SDL_RenderCopy(renderer, atlas, &quad.first, &quad.second))
+                throw std::runtime_error(SDL_GetError());
+#endif
+
+    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+    for (auto& entry : lines)
+    {
+        if (entry.second.outline)
+            SDL_RenderDrawRect(renderer, &entry.second.bounds);
+        entry.second.drawn = false;
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+
+// Overlay text from a glyph atlas: the printable ASCII range is rasterized
+// once into one texture, and every line becomes textured quads that are
+// drawn together in Flush. A line whose text and position are unchanged
+// since the last frame reuses its quads.
+class TextRenderer
+{
+    struct Line
+    {
+        std::string text;
+        // atlas source and screen destination for each glyph
+        std::vector<std::pair<SDL_Rect, SDL_Rect>> quads;
+        SDL_Rect bounds;
+        bool outline = false;
+        bool drawn = false;
+    };
+
+    static const int firstGlyph = 32;
+    static const int numGlyphs = 95;
+
+    SDL_Renderer* renderer;
+    SDL_Texture* atlas = nullptr;
+    SDL_Color color;
+    int atlasWidth = 0;
+    int atlasHeight = 0;
+    int lineHeight = 0;
+    SDL_Rect glyphs[numGlyphs];
+    int advances[numGlyphs];
+    std::map<std::pair<int, int>, Line> lines;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    std::vector<SDL_Vertex> batch;
+    std::vector<int> indices;
+#endif
+
+    void Layout(Line& line, int x, int y) const;
+
+    public:
+    TextRenderer(SDL_Renderer* renderer, TTF_Font* font, SDL_Color color);
+    ~TextRenderer();
+    TextRenderer(TextRenderer const&) = delete;
+    TextRenderer& operator=(TextRenderer const&) = delete;
+
+    int LineHeight() const { return lineHeight; }
+
+    // Queues a line with its top left corner at x, y.
+    void Draw(std::string const& text, int x, int y, bool outline);
+    // Draws everything queued since the last flush and forgets lines that
+    // were not drawn this time.
+    void Flush();
+};
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int numThreads) : nextTask(0)
+{
+    if (numThreads <= 0)
+        numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    for (int i = 1; i < numThreads; i++)
+        workers.emplace_back([this]() { Worker(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::RunTasks(Job const* func, int count)
+{
+    if (!func)
+        return;
+    int task;
+    while ((task = nextTask.fetch_add(1)) < count)
+    {
+        try
+        {
+            func->call(func->func, task);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failure)
+                failure = std::current_exception();
+        }
+    }
+}
+
+void ThreadPool::Worker()
+{
+    unsigned long seen = 0;
+    while (true)
+    {
+        Job const* func;
+        int count;
+        {
+            // A worker that wakes after the job finished sees no job here,
+            // so it never touches the task counter of the next one.
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return closing || generation != seen; });
+            if (closing)
+                return;
+            seen = generation;
+            func = job;
+            count = jobCount;
+            busy++;
+        }
+        RunTasks(func, count);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+        }
+        finished.notify_one();
+    }
+}
+
+void ThreadPool::Run(Job const& func, int count)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &func;
+        jobCount = count;
+        nextTask = 0;
+        failure = nullptr;
+        generation++;
+    }
+    wake.notify_all();
+    RunTasks(&func, count);
+    std::exception_ptr rethrow;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return busy == 0; });
+        job = nullptr;
+        jobCount = 0;
+        std::swap(rethrow, failure);
+    }
+    if (rethrow)
+        std::rethrow_exception(rethrow);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small persistent pool for data-parallel passes over a frame. The calling
+// thread takes part in the work, so a pool of size 1 runs everything inline.
+class ThreadPool
+{
+    public:
+    // numThreads counts the caller; 0 means one per hardware thread.
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    int Size() const { return (int)workers.size() + 1; }
+
+    // Calls func(task) for every task in [0, count) and waits for all of them.
+    // The workers only get a pointer to func, so a pass allocates nothing.
+    template<typename Func>
+        void ParallelFor(int count, Func const& func)
+        {
+            if (workers.empty() || count <= 1)
+            {
+                for (int task = 0; task < count; task++)
+                    func(task);
+                return;
+            }
+            Run(Job{ &func, [](void const* f, int task) { (*static_cast<Func const*>(f))(task); } }, count);
+        }
+
+    // Splits rows [0, height) into bands whose length is a multiple of
+    // rowAlign and calls func(begin, end) for each band.
+    template<typename Func>
+        void ParallelRows(int height, int rowAlign, Func const& func)
+        {
+            // A couple of bands per thread evens out uneven cores without
+            // making the bands so short that scheduling dominates.
+            int bands = Size() * 2;
+            int bandRows = (height + bands - 1) / bands;
+            bandRows = std::max((bandRows + rowAlign - 1) / rowAlign * rowAlign, rowAlign);
+            bands = (height + bandRows - 1) / bandRows;
+            ParallelFor(bands, [&](int band)
+                    {
+                    func(band * bandRows, std::min((band + 1) * bandRows, height));
+                    });
+        }
+
+    private:
+    // Non-owning reference to the caller's callable.
+    struct Job
+    {
+        void const* func;
+        void (*call)(void const* func, int task);
+    };
+
+    void Run(Job const& job, int count);
+    void Worker();
+    void RunTasks(Job const* func, int count);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    Job const* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextTask;
+    int busy = 0;
+    unsigned long generation = 0;
+    bool closing = false;
+    std::exception_ptr failure;
+};
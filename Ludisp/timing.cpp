@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include "timing.h"
+
+Timing timing;
+
+char const* Timing::Name(Stage stage)
+{
+    static char const* names[numStages] = {
+        "capture", "bin", "calibrate", "register", "stack", "statistics",
+        "sharpness", "stars", "handoff", "tone map", "upload", "present", "write", "latency",
+    };
+    return names[(int)stage];
+}
+
+int64_t Timing::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Small stable thread numbers read better in a trace viewer than hashes.
+static int ThreadNumber()
+{
+    static std::atomic<int> next(0);
+    thread_local int number = ++next;
+    return number;
+}
+
+Timing::Timing() : epoch(Now())
+{
+    for (auto& ring : rings)
+        ring.samples.resize(numSamples);
+}
+
+Timing::~Timing()
+{
+    if (!trace)
+        return;
+    if (json)
+        fputs("\n]\n", trace);
+    fclose(trace);
+}
+
+void Timing::OpenTrace(std::string const& filename)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (trace)
+        throw std::runtime_error("Trace file is already open");
+    trace = fopen(filename.c_str(), "w");
+    if (!trace)
+        throw std::runtime_error("Could not create " + filename);
+    traceBuffer.resize(1 << 20);
+    setvbuf(trace, traceBuffer.data(), _IOFBF, traceBuffer.size());
+    json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+    if (json)
+        fputs("[", trace);
+    else
+        fputs("stage,frame,thread,start_us,duration_us\n", trace);
+}
+
+void Timing::Record(Stage stage, unsigned long frame, int64_t start, int64_t end)
+{
+    float ms = (end - start) / 1e6f;
+    int thread = ThreadNumber();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& ring = rings[(int)stage];
+    ring.samples[ring.next] = ms;
+    ring.next = (ring.next + 1) % numSamples;
+    ring.count = std::min(ring.count + 1, (size_t)numSamples);
+    if (!trace)
+        return;
+    double startUs = (start - epoch) / 1e3;
+    double durationUs = (end - start) / 1e3;
+    if (json)
+    {
+        fprintf(trace, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lu}}",
+                firstEvent ? "" : ",", Name(stage), thread, startUs, durationUs, frame);
+        firstEvent = false;
+    }
+    else
+        fprintf(trace, "%s,%lu,%d,%.3f,%.3f\n", Name(stage), frame, thread, startUs, durationUs);
+}
+
+void Timing::Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& ring : rings)
+    {
+        ring.next = 0;
+        ring.count = 0;
+    }
+}
+
+Timing::Percentiles Timing::Get(Stage stage) const
+{
+    std::vector<float> samples;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto const& ring = rings[(int)stage];
+        samples.assign(ring.samples.begin(), ring.samples.begin() + ring.count);
+    }
+    Percentiles result;
+    result.samples = samples.size();
+    if (samples.empty())
+        return result;
+    auto p50 = samples.begin() + (samples.size() - 1) / 2;
+    std::nth_element(samples.begin(), p50, samples.end());
+    result.p50 = *p50;
+    auto p99 = samples.begin() + (samples.size() - 1) * 99 / 100;
+    std::nth_element(samples.begin(), p99, samples.end());
+    result.p99 = *p99;
+    return result;
+}
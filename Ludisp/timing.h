@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Per-stage durations for the whole pipeline, from the camera trigger to the
+// screen and the disk. Each stage keeps its most recent samples for the
+// overlay's percentiles, and every event can also be streamed to a CSV or
+// trace-event JSON file. A record is two clock reads and a short locked
+// write, a handful of times per frame.
+class Timing
+{
+    public:
+    enum class Stage
+    {
+        Capture,   // trigger until the frame is in its pool slot
+        Bin,       // software binning, when the camera can't bin
+        Calibrate,
+        Register,
+        Stack,
+        Statistics,
+        Sharpness,
+        Stars,     // star detection, on its own thread
+        Handoff,   // capture thread queue to display thread
+        ToneMap,
+        Upload,    // texture unlock and copy
+        Present,   // includes waiting for vsync
+        Write,
+        Latency,   // capture complete until first presented
+        Count
+    };
+    static const int numStages = (int)Stage::Count;
+
+    static char const* Name(Stage stage);
+    // Steady clock in nanoseconds.
+    static int64_t Now();
+
+    struct Percentiles
+    {
+        double p50 = 0; // ms
+        double p99 = 0;
+        size_t samples = 0;
+    };
+
+    Timing();
+    ~Timing();
+
+    void Record(Stage stage, unsigned long frame, int64_t start, int64_t end);
+    Percentiles Get(Stage stage) const;
+    // Forgets the samples of every stage, such as between benchmark runs.
+    void Reset();
+
+    // Streams every event from now on: trace-event JSON if the name ends in
+    // .json, CSV otherwise.
+    void OpenTrace(std::string const& filename);
+
+    private:
+    static const size_t numSamples = 512;
+
+    struct Ring
+    {
+        std::vector<float> samples;
+        size_t next = 0;
+        size_t count = 0;
+    };
+
+    mutable std::mutex mutex;
+    Ring rings[numStages];
+    FILE* trace = nullptr;
+    std::vector<char> traceBuffer;
+    bool json = false;
+    bool firstEvent = true;
+    int64_t epoch;
+};
+
+// The one instance every stage records into.
+extern Timing timing;
+
+// Records the lifetime of the scope as one stage of a frame.
+class StageTimer
+{
+    Timing::Stage stage;
+    unsigned long frame;
+    int64_t start;
+
+    public:
+    StageTimer(Timing::Stage stage, unsigned long frame)
+        : stage(stage), frame(frame), start(Timing::Now())
+    {
+    }
+    ~StageTimer()
+    {
+        timing.Record(stage, frame, start, Timing::Now());
+    }
+    StageTimer(StageTimer const&) = delete;
+    StageTimer& operator=(StageTimer const&) = delete;
+};
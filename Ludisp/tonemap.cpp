@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "tonemap.h"
+
+ToneMap::ToneMap()
+    // The AVX2 kernel gathers 32 bits at a time, so the last entry needs
+    // three bytes of slack behind it.
+    : lut(numEntries + 3),
+    gamma(std::numeric_limits<double>::quiet_NaN()),
+    darkThresh(std::numeric_limits<double>::quiet_NaN()),
+    black(std::numeric_limits<double>::quiet_NaN()),
+    midtone(std::numeric_limits<double>::quiet_NaN())
+{
+}
+
+bool ToneMap::Update(double newGamma, double newDarkThresh)
+{
+    if (newGamma == gamma && newDarkThresh == darkThresh)
+        return false;
+    gamma = newGamma;
+    darkThresh = newDarkThresh;
+    black = std::numeric_limits<double>::quiet_NaN();
+    for (int pixel = 0; pixel < numEntries; pixel++)
+    {
+        double value = ((double)pixel - darkThresh) / 65535;
+        // pow of a negative base is NaN for fractional gamma, so clamp first
+        if (value <= 0)
+        {
+            lut[pixel] = 0;
+            continue;
+        }
+        value = std::pow(std::min(value, 1.0), gamma);
+        lut[pixel] = (uint8_t)(value * 255);
+    }
+    return true;
+}
+
+bool ToneMap::UpdateStretch(double newBlack, double newMidtone)
+{
+    if (newBlack == black && newMidtone == midtone)
+        return false;
+    black = newBlack;
+    midtone = newMidtone;
+    gamma = std::numeric_limits<double>::quiet_NaN();
+    double range = std::max(65535 - black, 1.0);
+    for (int pixel = 0; pixel < numEntries; pixel++)
+        lut[pixel] = (uint8_t)(Mtf(midtone, (pixel - black) / range) * 255);
+    return true;
+}
+
+static void ApplyScalar(uint8_t const* lut, uint16_t const* src, uint32_t* dst, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = lut[src[i]] * 0x010101u;
+}
+
+static void ApplyRgbScalar(uint8_t const* lut, uint16_t const* red, uint16_t const* green,
+        uint16_t const* blue, uint32_t* dst, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = (uint32_t)lut[red[i]] << 16 | (uint32_t)lut[green[i]] << 8 | lut[blue[i]];
+}
+
+#if LUDISP_X86
+// Looks up raw pixels 2N and 2N+1 (mod 8) and stores both grey bytes in word N.
+template<int N>
+TARGET_SSE2 static inline __m128i LookupPair(uint8_t const* lut, __m128i raw, __m128i grey)
+{
+    return _mm_insert_epi16(grey,
+            lut[_mm_extract_epi16(raw, (N % 4) * 2)] |
+            lut[_mm_extract_epi16(raw, (N % 4) * 2 + 1)] << 8, N);
+}
+
+TARGET_SSE2 static void ApplySse2(uint8_t const* lut, uint16_t const* src, uint32_t* dst, int count)
+{
+    const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // SSE2 has no gather, so the lookups stay scalar; the win is in
+        // widening sixteen grey bytes to texels with four 16-byte stores.
+        __m128i raw0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+        __m128i raw1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i + 8));
+        __m128i grey = _mm_setzero_si128();
+        grey = LookupPair<0>(lut, raw0, grey);
+        grey = LookupPair<1>(lut, raw0, grey);
+        grey = LookupPair<2>(lut, raw0, grey);
+        grey = LookupPair<3>(lut, raw0, grey);
+        grey = LookupPair<4>(lut, raw1, grey);
+        grey = LookupPair<5>(lut, raw1, grey);
+        grey = LookupPair<6>(lut, raw1, grey);
+        grey = LookupPair<7>(lut, raw1, grey);
+        __m128i lo = _mm_unpacklo_epi8(grey, grey);
+        __m128i hi = _mm_unpackhi_epi8(grey, grey);
+        auto out = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(out + 0, _mm_and_si128(_mm_unpacklo_epi16(lo, lo), rgb));
+        _mm_storeu_si128(out + 1, _mm_and_si128(_mm_unpackhi_epi16(lo, lo), rgb));
+        _mm_storeu_si128(out + 2, _mm_and_si128(_mm_unpacklo_epi16(hi, hi), rgb));
+        _mm_storeu_si128(out + 3, _mm_and_si128(_mm_unpackhi_epi16(hi, hi), rgb));
+    }
+    ApplyScalar(lut, src + i, dst + i, count - i);
+}
+
+TARGET_AVX2 static void ApplyAvx2(uint8_t const* lut, uint16_t const* src, uint32_t* dst, int count)
+{
+    auto table = reinterpret_cast<int const*>(lut);
+    // Broadcasts byte 0 of every dword into the R, G and B bytes.
+    const __m256i spread = _mm256_setr_epi8(
+            0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1,
+            0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i raw = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+        __m256i idx0 = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw));
+        __m256i idx1 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1));
+        __m256i val0 = _mm256_i32gather_epi32(table, idx0, 1);
+        __m256i val1 = _mm256_i32gather_epi32(table, idx1, 1);
+        auto out = reinterpret_cast<__m256i*>(dst + i);
+        _mm256_storeu_si256(out + 0, _mm256_shuffle_epi8(val0, spread));
+        _mm256_storeu_si256(out + 1, _mm256_shuffle_epi8(val1, spread));
+    }
+    ApplyScalar(lut, src + i, dst + i, count - i);
+}
+
+// Eight texels per iteration: one gather per channel, each dword's low byte
+// moved into place.
+TARGET_AVX2 static void ApplyRgbAvx2(uint8_t const* lut, uint16_t const* red, uint16_t const* green,
+        uint16_t const* blue, uint32_t* dst, int count)
+{
+    auto table = reinterpret_cast<int const*>(lut);
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i r = _mm256_and_si256(_mm256_i32gather_epi32(table,
+                    _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(red + i))), 1), low);
+        __m256i g = _mm256_and_si256(_mm256_i32gather_epi32(table,
+                    _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(green + i))), 1), low);
+        __m256i b = _mm256_and_si256(_mm256_i32gather_epi32(table,
+                    _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(blue + i))), 1), low);
+        __m256i texels = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), texels);
+    }
+    ApplyRgbScalar(lut, red + i, green + i, blue + i, dst + i, count - i);
+}
+#endif
+
+void ToneMap::ApplyRgb(uint16_t const* red, uint16_t const* green, uint16_t const* blue,
+        uint32_t* dst, int count, SimdLevel level) const
+{
+#if LUDISP_X86
+    // without a gather the lookups are the whole cost, so SSE2 gains nothing
+    if (level == SimdLevel::Avx2)
+    {
+        ApplyRgbAvx2(lut.data(), red, green, blue, dst, count);
+        return;
+    }
+#else
+    (void)level;
+#endif
+    ApplyRgbScalar(lut.data(), red, green, blue, dst, count);
+}
+
+void ToneMap::Apply(uint16_t const* src, uint32_t* dst, int count, SimdLevel level) const
+{
+    switch (level)
+    {
+#if LUDISP_X86
+        case SimdLevel::Avx2:
+            ApplyAvx2(lut.data(), src, dst, count);
+            break;
+        case SimdLevel::Sse2:
+            ApplySse2(lut.data(), src, dst, count);
+            break;
+#endif
+        default:
+            ApplyScalar(lut.data(), src, dst, count);
+            break;
+    }
+}
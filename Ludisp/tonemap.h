@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "simd.h"
+
+// Midtones transfer function: maps 0 to 0, 1 to 1 and m to 0.5.
+inline double Mtf(double m, double x)
+{
+    if (x <= 0)
+        return 0;
+    if (x >= 1)
+        return 1;
+    return (m - 1) * x / ((2 * m - 1) * x - m);
+}
+
+// Maps raw 16-bit sensor values to 8-bit display values through a lookup
+// table, so the per-pixel work is a single load.
+class ToneMap
+{
+    std::vector<uint8_t> lut;
+    double gamma;
+    double darkThresh;
+    double black;
+    double midtone;
+
+    public:
+    static const int numEntries = 65536;
+
+    ToneMap();
+
+    // Rebuilds the table if the parameters changed. Returns true if it did.
+    bool Update(double gamma, double darkThresh);
+    // Same, for a stretch with black point in ADU and midtones balance m:
+    // black maps to 0, full scale to 255, and m of the way between to 128.
+    bool UpdateStretch(double black, double midtone);
+
+    uint8_t operator[](uint16_t value) const { return lut[value]; }
+    uint8_t const* Table() const { return lut.data(); }
+
+    // Converts count raw pixels to grey XRGB8888 texels.
+    void Apply(uint16_t const* src, uint32_t* dst, int count) const
+    {
+        Apply(src, dst, count, DetectSimd());
+    }
+    void Apply(uint16_t const* src, uint32_t* dst, int count, SimdLevel level) const;
+
+    // Converts count demosaiced pixels, one row per channel, to XRGB8888
+    // texels with the same curve on every channel.
+    void ApplyRgb(uint16_t const* red, uint16_t const* green, uint16_t const* blue,
+            uint32_t* dst, int count) const
+    {
+        ApplyRgb(red, green, blue, dst, count, DetectSimd());
+    }
+    void ApplyRgb(uint16_t const* red, uint16_t const* green, uint16_t const* blue,
+            uint32_t* dst, int count, SimdLevel level) const;
+};
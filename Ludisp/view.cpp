@@ -0,0 +1,60 @@
+#include <stdexcept>
+#include <string>
+#include "view.h"
+
+void ViewConverter::Reserve(int texWidth, int texHeight, int step)
+{
+    size_t size = (size_t)(texHeight + rowAlign - 1) / rowAlign * BandSize(texWidth, step);
+    if (scratch.size() < size)
+        scratch.resize(size);
+}
+
+void ViewConverter::Convert(uint16_t const* pixels, int width, int height, CfaPattern cfa, int x0, int y0,
+        int step, ToneMap const& toneMap, uint8_t* texels, ptrdiff_t pitch, int texWidth, int texHeight,
+        ThreadPool& pool)
+{
+    if (texWidth <= 0 || texHeight <= 0)
+        return;
+    size_t bandSize = BandSize(texWidth, step);
+    if (scratch.size() < (size_t)(texHeight + rowAlign - 1) / rowAlign * bandSize)
+        throw std::runtime_error("View scratch not reserved for a " + std::to_string(texWidth) + "x" +
+                std::to_string(texHeight) + " texture");
+    pool.ParallelRows(texHeight, rowAlign, [&](int begin, int end)
+            {
+            auto rows = scratch.data() + (size_t)(begin / rowAlign) * bandSize;
+            if (cfa != CfaPattern::None)
+            {
+                // Only the shown rows are demosaiced, over the visible
+                // columns, then every step-th pixel is kept.
+                int span = (texWidth - 1) * step + 1;
+                auto red = rows;
+                auto green = red + span;
+                auto blue = green + span;
+                for (int y = begin; y < end; y++)
+                {
+                    DemosaicRow(pixels, width, height, cfa, y0 + y * step, x0, x0 + span, red, green, blue);
+                    for (int x = 1; step > 1 && x < texWidth; x++)
+                    {
+                        red[x] = red[x * step];
+                        green[x] = green[x * step];
+                        blue[x] = blue[x * step];
+                    }
+                    toneMap.ApplyRgb(red, green, blue, reinterpret_cast<uint32_t*>(texels + y * pitch), texWidth);
+                }
+                return;
+            }
+            // decimated rows are gathered into a scratch row first so the
+            // conversion kernel always sees contiguous input
+            for (int y = begin; y < end; y++)
+            {
+                auto src = pixels + (ptrdiff_t)(y0 + y * step) * width + x0;
+                if (step > 1)
+                {
+                    for (int x = 0; x < texWidth; x++)
+                        rows[x] = src[x * step];
+                    src = rows;
+                }
+                toneMap.Apply(src, reinterpret_cast<uint32_t*>(texels + y * pitch), texWidth);
+            }
+            });
+}
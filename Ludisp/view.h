@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "demosaic.h"
+#include "threadpool.h"
+#include "tonemap.h"
+
+// Converts the visible part of a raw frame into an XRGB8888 texture for the
+// live view: texture row y takes every step-th pixel of frame row
+// y0 + y * step from column x0 on, demosaiced first for a colour sensor.
+// Bands of rows run on a pool, each with its own scratch rows, which are
+// reserved with the texture so converting never allocates.
+class ViewConverter
+{
+    public:
+    // Bands start on multiples of this many rows.
+    static const int rowAlign = 16;
+
+    // Call whenever the texture size or step changes. Only grows.
+    void Reserve(int texWidth, int texHeight, int step);
+
+    // Throws if Reserve wasn't called for this texture size and step.
+    void Convert(uint16_t const* pixels, int width, int height, CfaPattern cfa, int x0, int y0, int step,
+            ToneMap const& toneMap, uint8_t* texels, ptrdiff_t pitch, int texWidth, int texHeight,
+            ThreadPool& pool);
+
+    private:
+    // Enough for three demosaiced channels of a row, for each band.
+    static size_t BandSize(int texWidth, int step) { return (size_t)((texWidth - 1) * step + 1) * 3; }
+
+    std::vector<uint16_t> scratch;
+};